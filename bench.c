@@ -0,0 +1,394 @@
+// SPDX-License-Identifier: MIT
+/* Copyright (C) 2026, The libfailinj contributors */
+
+/*
+ * Benchmark payload for libfailinj. It recurses to the requested stack
+ * depth and then times a loop of intercepted calls made from a single
+ * call-site. bench.py primes the database so no failure is injected
+ * during the timed loop and runs this under different configurations.
+ * Optionally, a number of allocations are made beforehand and kept live
+ * during the loop, so the library's tracking tables hold that many
+ * entries. The churn operation replaces randomly chosen ones of them.
+ * The loop can also be run by several threads at once, each making the
+ * given number of calls and churning its own share of the allocations,
+ * in which case the time reported is the wall time divided by the calls
+ * made by all of them.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int bench_read(long iters)
+{
+	char buf[1];
+	long i;
+	int fd;
+
+	fd = open("/dev/zero", O_RDONLY);
+	if (fd == -1)
+		return 1;
+
+	for (i = 0; i < iters; i++) {
+		if (read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+			close(fd);
+			return 1;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
+static int bench_open(long iters)
+{
+	long i;
+	int fd;
+
+	for (i = 0; i < iters; i++) {
+		fd = open("/dev/null", O_RDONLY);
+		if (fd == -1)
+			return 1;
+		close(fd);
+	}
+
+	return 0;
+}
+
+static int bench_malloc(long iters)
+{
+	long i;
+	void *x;
+
+	for (i = 0; i < iters; i++) {
+		x = malloc(32);
+		if (!x)
+			return 1;
+		free(x);
+	}
+
+	return 0;
+}
+
+static void **live;
+static long nr_live;
+static __thread long live_first, live_nr;
+
+/* Free and reallocate random live allocations */
+static int bench_churn(long iters)
+{
+	unsigned long long seed = 88172645463325252ULL;
+	long i, idx;
+
+	if (!live_nr)
+		return bench_malloc(iters);
+
+	for (i = 0; i < iters; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		idx = live_first + seed % live_nr;
+
+		free(live[idx]);
+		live[idx] = malloc(16);
+		if (!live[idx])
+			return 1;
+	}
+
+	return 0;
+}
+
+/* The allocation is made by libc, not by the payload */
+static int bench_strdup(long iters)
+{
+	long i;
+	char *x;
+
+	for (i = 0; i < iters; i++) {
+		x = strdup("bench");
+		if (!x)
+			return 1;
+		free(x);
+	}
+
+	return 0;
+}
+
+struct worker {
+	const char *name;
+	long iters;
+	int ret;
+};
+
+static void *bench_worker(void *data)
+{
+	struct worker *w = data;
+
+	pthread_setname_np(pthread_self(), w->name);
+	w->ret = bench_malloc(w->iters);
+
+	return NULL;
+}
+
+static int spawn(const char *name, long iters)
+{
+	struct worker w = {name, iters};
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, bench_worker, &w))
+		return 1;
+	pthread_join(thread, NULL);
+
+	return w.ret;
+}
+
+/*
+ * The same code run by threads created from different places, two of
+ * which share a role
+ */
+static int bench_threads(long iters)
+{
+	if (spawn("worker-1", iters))
+		return 1;
+	if (spawn("worker-2", iters))
+		return 1;
+	return spawn("reader-1", iters);
+}
+
+static ucontext_t scheduler;
+static ucontext_t fiber;
+/* small like many fiber stacks, so the library must not need much of it */
+static char fiber_stack[16 * 1024];
+static int fiber_ret;
+
+static void bench_fiber(int iters_hi, int iters_lo)
+{
+	fiber_ret = bench_malloc((long)iters_hi << 32 | (unsigned int)iters_lo);
+}
+
+static int run_fiber(long iters)
+{
+	if (getcontext(&fiber))
+		return 1;
+
+	fiber.uc_stack.ss_sp = fiber_stack;
+	fiber.uc_stack.ss_size = sizeof(fiber_stack);
+	fiber.uc_link = &scheduler;
+	makecontext(&fiber, (void (*)(void))bench_fiber, 2,
+		    (int)(iters >> 32), (int)iters);
+
+	if (swapcontext(&scheduler, &fiber))
+		return 1;
+
+	return fiber_ret;
+}
+
+/*
+ * The same code run by fibers made in different places, from however
+ * deep a stack the benchmark is run at
+ */
+static int bench_fibers(long iters)
+{
+	if (run_fiber(iters))
+		return 1;
+	if (run_fiber(iters))
+		return 1;
+	return run_fiber(iters);
+}
+
+static int run(const char *op, long iters)
+{
+	if (!strcmp(op, "read"))
+		return bench_read(iters);
+	if (!strcmp(op, "open"))
+		return bench_open(iters);
+	if (!strcmp(op, "malloc"))
+		return bench_malloc(iters);
+	if (!strcmp(op, "churn"))
+		return bench_churn(iters);
+	if (!strcmp(op, "strdup"))
+		return bench_strdup(iters);
+	if (!strcmp(op, "threads"))
+		return bench_threads(iters);
+	if (!strcmp(op, "fibers"))
+		return bench_fibers(iters);
+
+	fprintf(stderr, "Unknown operation: %s\n", op);
+	return 1;
+}
+
+__attribute__((noinline))
+static int recurse(int depth, const char *op, long iters)
+{
+	volatile int ret;
+
+	if (depth <= 0)
+		return run(op, iters);
+
+	ret = recurse(depth - 1, op, iters);
+	return ret;
+}
+
+static int make_live(long nr)
+{
+	if (nr <= 0)
+		return 0;
+
+	live = calloc(nr, sizeof(*live));
+	if (!live)
+		return 1;
+
+	for (nr_live = 0; nr_live < nr; nr_live++) {
+		live[nr_live] = malloc(16);
+		if (!live[nr_live])
+			return 1;
+	}
+
+	return 0;
+}
+
+struct runner {
+	pthread_t thread;
+	const char *op;
+	int depth;
+	long iters;
+	long first;
+	long nr_live;
+	int ret;
+};
+
+/*
+ * The threads wait for all of them to be created, and are told to give
+ * up if creating one failed.
+ */
+static pthread_mutex_t start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static int start_state;
+
+static void *run_thread(void *data)
+{
+	struct runner *r = data;
+	int state;
+
+	live_first = r->first;
+	live_nr = r->nr_live;
+
+	pthread_mutex_lock(&start_mutex);
+	while (!start_state)
+		pthread_cond_wait(&start_cond, &start_mutex);
+	state = start_state;
+	pthread_mutex_unlock(&start_mutex);
+
+	if (state < 0)
+		return NULL;
+
+	r->ret = recurse(r->depth, r->op, r->iters);
+
+	return NULL;
+}
+
+/* Run the loop on nr threads, which share the live allocations */
+static int run_threads(int nr, const char *op, int depth, long iters,
+		       long long *start)
+{
+	struct runner *runners;
+	int i, ret = 0;
+
+	runners = calloc(nr, sizeof(*runners));
+	if (!runners)
+		return 1;
+
+	for (i = 0; i < nr; i++) {
+		runners[i].op = op;
+		runners[i].depth = depth;
+		runners[i].iters = iters;
+		runners[i].first = nr_live * i / nr;
+		runners[i].nr_live = nr_live * (i + 1) / nr - runners[i].first;
+		if (pthread_create(&runners[i].thread, NULL, run_thread,
+				   &runners[i])) {
+			ret = 1;
+			break;
+		}
+	}
+	nr = i;
+
+	pthread_mutex_lock(&start_mutex);
+	start_state = ret ? -1 : 1;
+	*start = now_ns();
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&start_mutex);
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(runners[i].thread, NULL);
+		ret |= runners[i].ret;
+	}
+
+	free(runners);
+	return ret;
+}
+
+/* Newest first, which is cheapest for any table that prepends entries */
+static void free_live(void)
+{
+	while (nr_live--)
+		free(live[nr_live]);
+	free(live);
+}
+
+int main(int argc, char *argv[])
+{
+	long long start, end;
+	int depth, threads = 1;
+	long iters;
+	int ret;
+
+	if (argc < 4 || argc > 6) {
+		fprintf(stderr,
+			"Usage: %s OP DEPTH ITERATIONS [LIVE [THREADS]]\n",
+			argv[0]);
+		return 1;
+	}
+
+	depth = atoi(argv[2]);
+	iters = atol(argv[3]);
+	if (argc == 6)
+		threads = atoi(argv[5]);
+	if (threads < 1)
+		threads = 1;
+
+	if (argc >= 5 && make_live(atol(argv[4]))) {
+		free_live();
+		return 1;
+	}
+
+	if (threads == 1) {
+		live_nr = nr_live;
+		start = now_ns();
+		ret = recurse(depth, argv[1], iters);
+	} else {
+		ret = run_threads(threads, argv[1], depth, iters, &start);
+	}
+	end = now_ns();
+
+	free_live();
+
+	if (!ret)
+		printf("%.1f\n", (double)(end - start) / iters / threads);
+
+	return ret;
+}
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: MIT
+
+"""Micro-benchmarks for libfailinj.
+
+Runs the bench payload under the library with a primed database (so
+every intercepted call does the full call-site lookup but no failure is
+injected) and reports the time per intercepted call in nanoseconds.
+"""
+
+import argparse
+import os
+import pathlib
+import subprocess
+import tempfile
+
+ROOT = pathlib.Path(__file__).absolute().parent
+
+CONFIGS = {
+    "libunwind": {},
+    "fp": {"FAILINJ_UNWINDER": "fp"},
+    "build-id": {"FAILINJ_CALLSITE_ID": "build-id"},
+    "fp+build-id": {"FAILINJ_UNWINDER": "fp",
+                    "FAILINJ_CALLSITE_ID": "build-id"},
+    "context4": {"FAILINJ_CONTEXT_DEPTH": "4"},
+    "fp+context4": {"FAILINJ_UNWINDER": "fp",
+                    "FAILINJ_CONTEXT_DEPTH": "4"},
+    "shadow": {"FAILINJ_CALLSITE_ID": "shadow"},
+    "exclude-libc": {"FAILINJ_EXCLUDE_CALLERS": "libc.so ld-linux"},
+    "crc32c": {"FAILINJ_HASH": "crc32c"},
+    "build-id+crc32c": {"FAILINJ_CALLSITE_ID": "build-id",
+                        "FAILINJ_HASH": "crc32c"},
+    "build-id+generic": {"FAILINJ_CALLSITE_ID": "build-id",
+                         "FAILINJ_HASH": "crc32c-generic"},
+    "build-id+mix128": {"FAILINJ_CALLSITE_ID": "build-id",
+                        "FAILINJ_HASH": "mix128"},
+    "build-id+verify": {"FAILINJ_CALLSITE_ID": "build-id",
+                        "FAILINJ_HASH": "mix128",
+                        "FAILINJ_VERIFY_CALLSITES": "1"},
+}
+
+# Configurations which need a differently built payload
+PAYLOADS = {
+    "shadow": "bench-shadow",
+}
+
+DONE = 34
+
+def run_bench(lib, env, op, depth, iters, db, payload, live=0, threads=1):
+    env = dict(env)
+    if lib is not None:
+        env["LD_PRELOAD"] = str(lib)
+        env["FAILINJ_DATABASE"] = str(db)
+    args = [str(payload), op, str(depth), str(iters), str(live),
+            str(threads)]
+    p = subprocess.run(args, cwd=ROOT, env=env, stdout=subprocess.PIPE,
+                       stderr=subprocess.DEVNULL, text=True)
+    return p.returncode, p.stdout.strip()
+
+def prime(lib, env, op, depth, db, payload, live, threads):
+    # the live allocations all come from one call-site
+    for i in range(200):
+        rc, _ = run_bench(lib, env, op, depth, 1, db, payload,
+                          min(live, threads), threads)
+        if rc == DONE:
+            return
+    raise RuntimeError(f"Unable to prime database for {op}")
+
+def bench(lib, env, op, depth, iters, payload, live=0, threads=1):
+    with tempfile.NamedTemporaryFile() as db:
+        if lib is not None:
+            prime(lib, env, op, depth, db.name, payload, live, threads)
+        rc, out = run_bench(lib, env, op, depth, iters, db.name, payload,
+                            live, threads)
+        if lib is not None and rc != DONE:
+            raise RuntimeError(f"Benchmark {op} failed with {rc}")
+        return float(out)
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--lib", default=str(ROOT / "libfailinj.so"),
+                        help="library to benchmark")
+    parser.add_argument("--payload", default=str(ROOT / "bench"),
+                        help="benchmark payload to run")
+    parser.add_argument("--configs", default=",".join(CONFIGS),
+                        help="comma separated configurations to run")
+    parser.add_argument("--ops", default="read,malloc",
+                        help="comma separated operations to time")
+    parser.add_argument("--depths", default="8,32,128",
+                        help="comma separated stack depths")
+    parser.add_argument("--iters", type=int, default=20000,
+                        help="intercepted calls per measurement")
+    parser.add_argument("--live", default="0",
+                        help="comma separated numbers of allocations "
+                             "kept live while timing")
+    parser.add_argument("--threads", default="1",
+                        help="comma separated numbers of threads running "
+                             "the timed loop at once")
+    args = parser.parse_args()
+
+    print(f"{'config':<16} {'op':<8} {'depth':>6} {'live':>9} "
+          f"{'threads':>7} {'ns/call':>10} {'native':>8}")
+    for cfg in args.configs.split(","):
+        for op in args.ops.split(","):
+            for depth in [int(d) for d in args.depths.split(",")]:
+                for live in [int(n) for n in args.live.split(",")]:
+                    for threads in [int(n) for n in
+                                    args.threads.split(",")]:
+                        native = bench(None, {}, op, depth, args.iters,
+                                       args.payload, live, threads)
+                        payload = args.payload
+                        if cfg in PAYLOADS:
+                            payload = str(ROOT / PAYLOADS[cfg])
+                        t = bench(args.lib, CONFIGS[cfg], op, depth,
+                                  args.iters, payload, live, threads)
+                        print(f"{cfg:<16} {op:<8} {depth:>6} {live:>9} "
+                              f"{threads:>7} {t:>10.1f} {native:>8.1f}")
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: MIT */
+/* Copyright (C) 2026, The libfailinj contributors */
+
+/*
+ * Format of the call-site database, shared by libfailinj and
+ * failinj-migrate.
+ *
+ * A database starts with struct db_header. context_key is a hash of the
+ * settings limiting which frames make up a call-site (the context
+ * depths and the anchor functions), which only ever get compared. Each
+ * call-site is recorded as its hash, followed by the high half for
+ * 128-bit schemes and, when verifying call-sites, the number of frames
+ * and two words per frame.
+ */
+
+#ifndef FAILINJ_DB_H
+#define FAILINJ_DB_H
+
+#include <stdint.h>
+
+#define DB_MAGIC "FAILINJ\1"
+#define DB_VERIFY_CALLSITES 1
+#define DB_THREAD_ORIGIN 2
+#define DB_THREAD_ROLE 4
+#define DB_FIBER_ORIGIN 8
+
+enum callsite_id {
+	CALLSITE_ID_SYMBOL,
+	CALLSITE_ID_BUILD_ID,
+	CALLSITE_ID_SHADOW,
+	CALLSITE_ID_LINE,
+};
+
+/*
+ * How the identity of each frame is turned into the call-site hash. The
+ * hashes stored in a database are only meaningful with the scheme that
+ * created them so the way a scheme works must never change; anything
+ * else needs a new scheme. The values are stored in the database.
+ */
+enum hash_scheme {
+	HASH_DJB,
+	HASH_CRC32C,
+	HASH_MIX128,
+};
+
+struct db_header {
+	char magic[8];
+	uint32_t hash_scheme;
+	uint32_t callsite_id;
+	uint32_t flags;
+	uint32_t collapse_cycles;
+	uint64_t context_key;
+};
+
+#endif
@@ -0,0 +1,259 @@
+/* SPDX-License-Identifier: MIT */
+/* Copyright (C) 2026, The libfailinj contributors */
+
+/*
+ * Reading the ELF files backing loaded modules, shared by libfailinj and
+ * its tools: the build-id that identifies a module, the functions in its
+ * symbol tables and its sections. Function names resolved by the tools
+ * must be the ones libfailinj hashed, so they all pick symbols the same
+ * way, which is also the way libunwind does.
+ */
+
+#ifndef FAILINJ_ELF_H
+#define FAILINJ_ELF_H
+
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "failinj-hash.h"
+
+/*
+ * A function found in a symbol table: its address relative to the
+ * module's base, its name as an offset into the file and the order it
+ * was found in. The layout is also that of libfailinj's symbol cache.
+ */
+struct symbol {
+	uint64_t off;
+	uint32_t name;
+	uint32_t seq;
+};
+
+struct elf_image {
+	char *map;
+	size_t size;
+	const ElfW(Ehdr) *ehdr;
+	const ElfW(Shdr) *shdrs;
+};
+
+/* The id of a module is the djb hash of its GNU build-id note */
+static inline bool elf_note_build_id(const char *p, size_t len, size_t align,
+				     unsigned long long *id)
+{
+	const char *end = p + len;
+	const ElfW(Nhdr) *n;
+	const char *name, *desc;
+
+	while (p + sizeof(*n) <= end) {
+		n = (const void *)p;
+		name = p + sizeof(*n);
+		desc = name + ((n->n_namesz + align - 1) & ~(align - 1));
+
+		if (n->n_type == NT_GNU_BUILD_ID && n->n_namesz == 4 &&
+		    !memcmp(name, "GNU", 4) && desc + n->n_descsz <= end) {
+			*id = djb_hash_mem(desc, n->n_descsz, HASH_INIT);
+			return true;
+		}
+
+		p = desc + ((n->n_descsz + align - 1) & ~(align - 1));
+	}
+
+	return false;
+}
+
+/*
+ * Map the file at path read-only and check its section headers are
+ * within it. Returns false if it cannot be read or is not an ELF file.
+ * close() must be declared by the includer: libfailinj cannot include
+ * <unistd.h>.
+ */
+static inline bool elf_open(struct elf_image *e, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*e->ehdr)) {
+		close(fd);
+		return false;
+	}
+
+	e->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (e->map == MAP_FAILED)
+		return false;
+
+	e->size = st.st_size;
+	e->ehdr = (const void *)e->map;
+	e->shdrs = (const void *)(e->map + e->ehdr->e_shoff);
+
+	if (memcmp(e->ehdr->e_ident, ELFMAG, SELFMAG) ||
+	    e->ehdr->e_shentsize != sizeof(*e->shdrs) ||
+	    e->ehdr->e_shoff + e->ehdr->e_shnum * sizeof(*e->shdrs) >
+	    e->size) {
+		munmap(e->map, e->size);
+		return false;
+	}
+
+	return true;
+}
+
+static inline void elf_close(struct elf_image *e)
+{
+	munmap(e->map, e->size);
+}
+
+static inline bool elf_section_ok(const struct elf_image *e,
+				  const ElfW(Shdr) *sh)
+{
+	return sh->sh_offset + sh->sh_size <= e->size;
+}
+
+/* Find the build-id in the file's note sections */
+static inline bool elf_build_id(const struct elf_image *e,
+				unsigned long long *id)
+{
+	const ElfW(Shdr) *sh;
+	int i;
+
+	for (i = 0; i < e->ehdr->e_shnum; i++) {
+		sh = &e->shdrs[i];
+		if (sh->sh_type == SHT_NOTE && elf_section_ok(e, sh) &&
+		    elf_note_build_id(e->map + sh->sh_offset, sh->sh_size,
+				      sh->sh_addralign == 8 ? 8 : 4, id))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Find an uncompressed section holding data by name. Returns NULL if
+ * there is none.
+ */
+static inline const ElfW(Shdr) *elf_section(const struct elf_image *e,
+					    const char *name)
+{
+	const ElfW(Shdr) *sh, *strsh;
+	int i;
+
+	if (e->ehdr->e_shstrndx >= e->ehdr->e_shnum)
+		return NULL;
+
+	strsh = &e->shdrs[e->ehdr->e_shstrndx];
+	if (!elf_section_ok(e, strsh))
+		return NULL;
+
+	for (i = 0; i < e->ehdr->e_shnum; i++) {
+		sh = &e->shdrs[i];
+		if (sh->sh_type == SHT_PROGBITS &&
+		    !(sh->sh_flags & SHF_COMPRESSED) &&
+		    sh->sh_name < strsh->sh_size && elf_section_ok(e, sh) &&
+		    !strcmp(e->map + strsh->sh_offset + sh->sh_name, name))
+			return sh;
+	}
+
+	return NULL;
+}
+
+typedef void elf_function_fn(void *data, const ElfW(Sym) *sym,
+			     uint64_t name);
+
+/*
+ * Call fn for every function defined in the file's symbol tables with
+ * the offset of its name into the file. Indirect functions are left out:
+ * their symbols point at the resolver, which only runs when the loader
+ * binds them, and libunwind does not name frames after them either.
+ */
+static inline void elf_for_each_function(const struct elf_image *e,
+					 elf_function_fn *fn, void *data)
+{
+	const ElfW(Shdr) *sh, *strsh;
+	const ElfW(Sym) *sym;
+	size_t j;
+	int i;
+
+	for (i = 0; i < e->ehdr->e_shnum; i++) {
+		sh = &e->shdrs[i];
+		if (sh->sh_type != SHT_SYMTAB && sh->sh_type != SHT_DYNSYM)
+			continue;
+
+		if (sh->sh_link >= e->ehdr->e_shnum || !elf_section_ok(e, sh))
+			continue;
+
+		strsh = &e->shdrs[sh->sh_link];
+		if (!elf_section_ok(e, strsh))
+			continue;
+
+		sym = (const void *)(e->map + sh->sh_offset);
+		for (j = 0; j < sh->sh_size / sizeof(*sym); j++, sym++) {
+			if (ELF64_ST_TYPE(sym->st_info) != STT_FUNC)
+				continue;
+
+			if (sym->st_shndx == SHN_UNDEF ||
+			    sym->st_name >= strsh->sh_size)
+				continue;
+
+			fn(data, sym, strsh->sh_offset + sym->st_name);
+		}
+	}
+}
+
+static inline int cmp_symbol(const void *a, const void *b)
+{
+	const struct symbol *sa = a, *sb = b;
+
+	if (sa->off != sb->off)
+		return sa->off < sb->off ? -1 : 1;
+	return sa->seq < sb->seq ? -1 : sa->seq > sb->seq;
+}
+
+/*
+ * Sort the symbols and keep only the first one found at each address,
+ * which is the one libunwind picks, so names (and so call-site hashes)
+ * are the same as those from unw_get_proc_name(). Returns how many are
+ * left.
+ */
+static inline size_t symbols_sort(struct symbol *syms, size_t nr_syms)
+{
+	size_t i, nr = 0;
+
+	qsort(syms, nr_syms, sizeof(*syms), cmp_symbol);
+
+	for (i = 0; i < nr_syms; i++)
+		if (!nr || syms[i].off != syms[nr - 1].off)
+			syms[nr++] = syms[i];
+
+	return nr;
+}
+
+/*
+ * Find the last symbol starting at or before off, which is the function
+ * containing it. Returns NULL if there is none.
+ */
+static inline const struct symbol *symbols_find(const struct symbol *syms,
+						size_t nr, uint64_t off)
+{
+	size_t lo = 0, hi = nr, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (syms[mid].off <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo ? &syms[lo - 1] : NULL;
+}
+
+#endif
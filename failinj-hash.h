@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: MIT */
+/* Copyright (C) 2026, The libfailinj contributors */
+
+/*
+ * The hash functions call-site hashes and module ids are made of, shared
+ * by libfailinj and the tools that read what it writes. Hashes end up
+ * in databases and logs, so none of these may ever change how they
+ * work; anything else needs a new function.
+ */
+
+#ifndef FAILINJ_HASH_H
+#define FAILINJ_HASH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Simple hash function based on
+ *  http://www.cse.yorku.ca/~oz/hash.html
+ */
+#define HASH_INIT 53815381
+
+static inline unsigned long long djb_hash(const char *inp,
+					  unsigned long long hash)
+{
+	while(*inp)
+		hash = (hash * 33) ^ *inp++;
+
+	return hash;
+}
+
+static inline unsigned long long djb_hash_mem(const void *inp, size_t len,
+					      unsigned long long hash)
+{
+	const unsigned char *p = inp;
+
+	while (len--)
+		hash = (hash * 33) ^ *p++;
+
+	return hash;
+}
+
+/*
+ * CRC32C based hash over 64-bit words. Two CRC32C lanes run side by
+ * side: the first over each word and the second over the word
+ * multiplied by CRC32C_MIX, which breaks up the linearity of the CRC.
+ * They form the low and high 32 bits of the hash respectively. The
+ * instruction in SSE4.2 is used when the CPU has it, otherwise a table
+ * driven version which gives the same result.
+ */
+#define CRC32C_POLY 0x82f63b78
+#define CRC32C_MIX 0x9e3779b97f4a7c15ULL
+
+typedef unsigned long long hash_words_fn(const unsigned long long *w,
+					 int nr, unsigned long long hash);
+
+static uint32_t crc32c_table[256];
+
+static inline void crc32c_init_table(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[i] = crc;
+	}
+}
+
+static inline uint32_t crc32c_word(uint32_t crc, unsigned long long w)
+{
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		crc = crc32c_table[(crc ^ w) & 0xff] ^ (crc >> 8);
+		w >>= 8;
+	}
+
+	return crc;
+}
+
+static inline unsigned long long
+crc32c_hash_generic(const unsigned long long *w, int nr,
+		    unsigned long long hash)
+{
+	uint32_t lo = hash, hi = hash >> 32;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		lo = crc32c_word(lo, w[i]);
+		hi = crc32c_word(hi, w[i] * CRC32C_MIX);
+	}
+
+	return (unsigned long long)hi << 32 | lo;
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static inline unsigned long long
+crc32c_hash_sse42(const unsigned long long *w, int nr,
+		  unsigned long long hash)
+{
+	unsigned long long lo = (uint32_t)hash, hi = hash >> 32;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		lo = __builtin_ia32_crc32di(lo, w[i]);
+		hi = __builtin_ia32_crc32di(hi, w[i] * CRC32C_MIX);
+	}
+
+	return hi << 32 | lo;
+}
+#endif
+
+static inline hash_words_fn *crc32c_kernel(bool generic)
+{
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	if (!generic && __builtin_cpu_supports("sse4.2"))
+		return crc32c_hash_sse42;
+#endif
+
+	crc32c_init_table();
+	return crc32c_hash_generic;
+}
+
+static inline unsigned long long fmix64(unsigned long long x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+
+	return x;
+}
+
+/*
+ * 128-bit hash over 64-bit words made of two lanes, each mixing in every
+ * word with the MurmurHash3 finalizer. The second lane takes the word
+ * with its halves swapped plus the new state of the first lane.
+ */
+static inline void mix128_words(const unsigned long long *w, int nr,
+				unsigned long long *lo, unsigned long long *hi)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		*lo = fmix64(*lo ^ w[i]);
+		*hi = fmix64((*hi ^ (w[i] << 32 | w[i] >> 32)) + *lo);
+	}
+}
+
+#endif
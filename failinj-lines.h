@@ -0,0 +1,323 @@
+/* SPDX-License-Identifier: MIT */
+/* Copyright (C) 2026, The libfailinj contributors */
+
+/*
+ * Reader for the DWARF line number tables in .debug_line, shared by
+ * libfailinj and failinj-migrate. Only the address, line and column of
+ * each row are kept, which is all that is needed to tell the calls in a
+ * function apart; file names and the other registers are skipped.
+ * Versions 2 to 5 of the format are understood.
+ */
+
+#ifndef FAILINJ_LINES_H
+#define FAILINJ_LINES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct line_row {
+	uint64_t addr;
+	uint32_t line;
+	uint16_t column;
+	uint16_t end;
+};
+
+struct line_table {
+	struct line_row *rows;
+	size_t nr;
+	size_t alloc;
+};
+
+typedef void *line_realloc_fn(void *p, size_t size);
+
+static uint64_t dw_uleb(const uint8_t **p, const uint8_t *end)
+{
+	uint64_t val = 0;
+	int shift = 0;
+	uint8_t b;
+
+	while (*p < end) {
+		b = *(*p)++;
+		if (shift < 64)
+			val |= (uint64_t)(b & 0x7f) << shift;
+		shift += 7;
+		if (!(b & 0x80))
+			break;
+	}
+
+	return val;
+}
+
+static int64_t dw_sleb(const uint8_t **p, const uint8_t *end)
+{
+	uint64_t val = 0;
+	int shift = 0;
+	uint8_t b = 0;
+
+	while (*p < end) {
+		b = *(*p)++;
+		if (shift < 64)
+			val |= (uint64_t)(b & 0x7f) << shift;
+		shift += 7;
+		if (!(b & 0x80))
+			break;
+	}
+
+	if (shift < 64 && (b & 0x40))
+		val |= -1ULL << shift;
+
+	return val;
+}
+
+static bool dw_read(const uint8_t **p, const uint8_t *end, void *out,
+		    size_t size)
+{
+	if (size > end - *p)
+		return false;
+
+	memcpy(out, *p, size);
+	*p += size;
+	return true;
+}
+
+/*
+ * Rows for the same address replace each other so that only the last,
+ * which is the one that applies, is kept. That leaves the addresses
+ * within each sequence strictly increasing.
+ */
+static void line_table_add(struct line_table *t, size_t first, uint64_t addr,
+			   int64_t line, uint64_t column, bool end,
+			   line_realloc_fn *grow)
+{
+	struct line_row *row;
+
+	if (t->nr > first && t->rows[t->nr - 1].addr == addr) {
+		row = &t->rows[t->nr - 1];
+	} else {
+		if (t->nr == t->alloc) {
+			t->alloc = t->alloc ? t->alloc * 2 : 1024;
+			t->rows = grow(t->rows, t->alloc * sizeof(*t->rows));
+		}
+		row = &t->rows[t->nr++];
+	}
+
+	row->addr = addr;
+	row->line = line;
+	row->column = column > UINT16_MAX ? UINT16_MAX : column;
+	row->end = end;
+}
+
+static void line_program_run(struct line_table *t, const uint8_t *p,
+			     const uint8_t *end, const uint8_t *std_lens,
+			     uint8_t min_inst, int8_t line_base,
+			     uint8_t line_range, uint8_t opcode_base,
+			     line_realloc_fn *grow)
+{
+	uint64_t addr = 0, column = 0, len, adj;
+	size_t first = t->nr;
+	int64_t line = 1;
+	const uint8_t *next;
+	uint16_t fixed;
+	uint8_t op;
+	int i;
+
+	while (p < end) {
+		op = *p++;
+
+		if (op >= opcode_base) {
+			adj = op - opcode_base;
+			addr += adj / line_range * min_inst;
+			line += line_base + (int64_t)(adj % line_range);
+			line_table_add(t, first, addr, line, column, false,
+				       grow);
+			continue;
+		}
+
+		switch (op) {
+		case 0:
+			len = dw_uleb(&p, end);
+			if (!len || len > end - p)
+				return;
+			next = p + len;
+
+			op = *p++;
+			if (op == 1) {
+				/* DW_LNE_end_sequence */
+				line_table_add(t, first, addr, line, column,
+					       true, grow);
+
+				/* drop code the linker discarded */
+				if (t->rows[first].addr == 0)
+					t->nr = first;
+
+				first = t->nr;
+				addr = column = 0;
+				line = 1;
+			} else if (op == 2 && len == 9) {
+				/* DW_LNE_set_address */
+				memcpy(&addr, p, sizeof(addr));
+			}
+
+			p = next;
+			break;
+		case 1:
+			/* DW_LNS_copy */
+			line_table_add(t, first, addr, line, column, false,
+				       grow);
+			break;
+		case 2:
+			/* DW_LNS_advance_pc */
+			addr += dw_uleb(&p, end) * min_inst;
+			break;
+		case 3:
+			/* DW_LNS_advance_line */
+			line += dw_sleb(&p, end);
+			break;
+		case 5:
+			/* DW_LNS_set_column */
+			column = dw_uleb(&p, end);
+			break;
+		case 8:
+			/* DW_LNS_const_add_pc */
+			addr += (255 - opcode_base) / line_range * min_inst;
+			break;
+		case 9:
+			/* DW_LNS_fixed_advance_pc */
+			if (!dw_read(&p, end, &fixed, sizeof(fixed)))
+				return;
+			addr += fixed;
+			break;
+		default:
+			for (i = 0; i < std_lens[op - 1]; i++)
+				dw_uleb(&p, end);
+			break;
+		}
+	}
+}
+
+static int cmp_line_row(const void *a, const void *b)
+{
+	const struct line_row *ra = a, *rb = b;
+
+	if (ra->addr != rb->addr)
+		return ra->addr < rb->addr ? -1 : 1;
+
+	/* a sequence may start where another one ends */
+	return rb->end - ra->end;
+}
+
+/*
+ * Add the rows of every unit in a .debug_line section to the table and
+ * sort them by address. Units that cannot be understood are skipped.
+ */
+static void line_table_parse(struct line_table *t, const void *data,
+			     size_t size, line_realloc_fn *grow)
+{
+	const uint8_t *p = data, *end = p + size, *unit_end, *prog;
+	uint8_t min_inst, max_ops, is_stmt, line_range, opcode_base;
+	uint64_t len, hdr_len = 0;
+	uint32_t len32, hdr_len32;
+	uint16_t version, sizes;
+	int8_t line_base;
+	bool dw64;
+
+	while (dw_read(&p, end, &len32, sizeof(len32))) {
+		len = len32;
+		dw64 = len32 == 0xffffffff;
+		if (dw64 && !dw_read(&p, end, &len, sizeof(len)))
+			break;
+		if (len > end - p)
+			break;
+
+		unit_end = p + len;
+		if (!dw_read(&p, unit_end, &version, sizeof(version)) ||
+		    version < 2 || version > 5) {
+			p = unit_end;
+			continue;
+		}
+
+		/* address and segment selector sizes */
+		if (version >= 5 && !dw_read(&p, unit_end, &sizes,
+					     sizeof(sizes)))
+			break;
+
+		if (dw64) {
+			if (!dw_read(&p, unit_end, &hdr_len, sizeof(hdr_len)))
+				break;
+		} else {
+			if (!dw_read(&p, unit_end, &hdr_len32,
+				     sizeof(hdr_len32)))
+				break;
+			hdr_len = hdr_len32;
+		}
+
+		if (hdr_len > unit_end - p)
+			break;
+		prog = p + hdr_len;
+
+		max_ops = 1;
+		if (!dw_read(&p, prog, &min_inst, 1) ||
+		    (version >= 4 && !dw_read(&p, prog, &max_ops, 1)) ||
+		    !dw_read(&p, prog, &is_stmt, 1) ||
+		    !dw_read(&p, prog, &line_base, 1) ||
+		    !dw_read(&p, prog, &line_range, 1) ||
+		    !dw_read(&p, prog, &opcode_base, 1) ||
+		    !line_range || !opcode_base || max_ops != 1 ||
+		    opcode_base - 1 > prog - p) {
+			p = unit_end;
+			continue;
+		}
+
+		line_program_run(t, prog, unit_end, p, min_inst, line_base,
+				 line_range, opcode_base, grow);
+		p = unit_end;
+	}
+
+	qsort(t->rows, t->nr, sizeof(*t->rows), cmp_line_row);
+}
+
+/* Find the row for the instruction at addr, NULL if no sequence has it */
+static const struct line_row *line_table_find(const struct line_table *t,
+					      uint64_t addr)
+{
+	size_t lo = 0, hi = t->nr, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (t->rows[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || t->rows[lo - 1].end)
+		return NULL;
+
+	return &t->rows[lo - 1];
+}
+
+/*
+ * The word identifying a call by its position in the function's source:
+ * the line relative to the function's first line and the column. The top
+ * bit keeps it apart from the offsets used when there is no line info.
+ * Returns zero if the table does not cover the call.
+ */
+static uint64_t line_table_word(const struct line_table *t, uint64_t func,
+				uint64_t call)
+{
+	const struct line_row *row, *start;
+	uint32_t line;
+
+	row = line_table_find(t, call);
+	if (!row)
+		return 0;
+
+	start = line_table_find(t, func);
+	line = row->line - (start ? start->line : 0);
+
+	return 1ULL << 63 | (uint64_t)line << 16 | row->column;
+}
+
+#endif
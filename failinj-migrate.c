@@ -0,0 +1,338 @@
+// SPDX-License-Identifier: MIT
+/* Copyright (C) 2026, The libfailinj contributors */
+
+/*
+ * Carry the call-sites of a database over to FAILINJ_CALLSITE_ID=line so
+ * that a campaign survives the program being rebuilt.
+ *
+ * Usage: failinj-migrate OLD_DB NEW_DB FILE...
+ *
+ * OLD_DB must identify call-sites by symbol (the default) and have been
+ * recorded with FAILINJ_VERIFY_CALLSITES, so the function name hash and
+ * offset of every frame is known. FILE lists the programs and libraries
+ * it was recorded against, as they were then. Each frame in one of them
+ * is looked up by name and offset in their symbol and line tables and
+ * rewritten as a line mode frame; other frames are kept as they are,
+ * just as libfailinj does for modules without line info. A call-site is
+ * dropped if any of its functions' names is not unique among the files.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "failinj-db.h"
+#include "failinj-elf.h"
+#include "failinj-hash.h"
+#include "failinj-lines.h"
+
+#define MAX_FRAMES 256
+
+struct elf_file {
+	const char *path;
+	const char *names;
+	struct line_table lines;
+};
+
+struct function {
+	unsigned long long name;
+	uint64_t addr;
+	struct elf_file *file;
+};
+
+struct callsite {
+	unsigned long long hash;
+	unsigned long long hash_hi;
+	uint32_t nr;
+	unsigned long long *keys;
+};
+
+static struct function *funcs;
+static size_t nr_funcs, alloc_funcs;
+static hash_words_fn *crc32c_hash;
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		perror("failinj-migrate");
+		exit(1);
+	}
+
+	return p;
+}
+
+static void add_function(void *data, const ElfW(Sym) *sym, uint64_t name)
+{
+	struct elf_file *f = data;
+
+	if (nr_funcs == alloc_funcs) {
+		alloc_funcs = alloc_funcs ? alloc_funcs * 2 : 1024;
+		funcs = xrealloc(funcs, alloc_funcs * sizeof(*funcs));
+	}
+
+	funcs[nr_funcs].name = djb_hash(f->names + name, HASH_INIT);
+	funcs[nr_funcs].addr = sym->st_value;
+	funcs[nr_funcs].file = f;
+	nr_funcs++;
+}
+
+static int cmp_function(const void *a, const void *b)
+{
+	const struct function *fa = a, *fb = b;
+
+	if (fa->name != fb->name)
+		return fa->name < fb->name ? -1 : 1;
+	if (fa->file != fb->file)
+		return fa->file < fb->file ? -1 : 1;
+	if (fa->addr != fb->addr)
+		return fa->addr < fb->addr ? -1 : 1;
+	return 0;
+}
+
+/* Collect the functions and line table of a file */
+static void elf_load(struct elf_file *f)
+{
+	const ElfW(Shdr) *sh;
+	struct elf_image e;
+
+	if (!elf_open(&e, f->path)) {
+		fprintf(stderr, "%s: not a readable ELF file\n", f->path);
+		exit(1);
+	}
+
+	f->names = e.map;
+	elf_for_each_function(&e, add_function, f);
+
+	sh = elf_section(&e, ".debug_line");
+	if (sh)
+		line_table_parse(&f->lines, e.map + sh->sh_offset,
+				 sh->sh_size, xrealloc);
+	else
+		fprintf(stderr, "%s: no line info, its frames are kept as they are\n",
+			f->path);
+
+	elf_close(&e);
+	f->names = NULL;
+}
+
+/*
+ * Find the function a name hash refers to. Returns NULL if no file has
+ * it and sets ambiguous if more than one function goes by that name.
+ */
+static const struct function *find_function(unsigned long long name,
+					    bool *ambiguous)
+{
+	size_t lo = 0, hi = nr_funcs, mid;
+	const struct function *f;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (funcs[mid].name < name)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == nr_funcs || funcs[lo].name != name)
+		return NULL;
+
+	f = &funcs[lo];
+	*ambiguous = lo + 1 < nr_funcs && funcs[lo + 1].name == name;
+	return f;
+}
+
+/* Rewrite the frames of a call-site, returns false if it must be dropped */
+static bool migrate_frames(unsigned long long *keys, uint32_t nr)
+{
+	const struct function *f;
+	bool ambiguous = false;
+	unsigned long long word;
+	uint32_t i;
+
+	for (i = 0; i < nr; i++) {
+		f = find_function(keys[i * 2], &ambiguous);
+		if (ambiguous)
+			return false;
+		if (!f)
+			continue;
+
+		word = line_table_word(&f->file->lines, f->addr,
+				       f->addr + keys[i * 2 + 1] - 1);
+		if (word)
+			keys[i * 2 + 1] = word;
+	}
+
+	return true;
+}
+
+static void hash_callsite(struct callsite *c, int scheme)
+{
+	uint32_t i;
+
+	c->hash = HASH_INIT;
+	c->hash_hi = 0;
+
+	for (i = 0; i < c->nr; i++) {
+		if (scheme == HASH_DJB)
+			c->hash = djb_hash_mem(&c->keys[i * 2],
+					       2 * sizeof(*c->keys), c->hash);
+		else if (scheme == HASH_CRC32C)
+			c->hash = crc32c_hash(&c->keys[i * 2], 2, c->hash);
+		else
+			mix128_words(&c->keys[i * 2], 2, &c->hash,
+				     &c->hash_hi);
+	}
+}
+
+static int cmp_callsite(const void *a, const void *b)
+{
+	const struct callsite *ca = a, *cb = b;
+
+	if (ca->hash != cb->hash)
+		return ca->hash < cb->hash ? -1 : 1;
+	if (ca->hash_hi != cb->hash_hi)
+		return ca->hash_hi < cb->hash_hi ? -1 : 1;
+	return 0;
+}
+
+static bool read_all(FILE *f, void *buf, size_t size)
+{
+	return !size || fread(buf, size, 1, f) == 1;
+}
+
+static void write_all(FILE *f, const void *buf, size_t size, const char *path)
+{
+	if (size && fwrite(buf, size, 1, f) != 1) {
+		perror(path);
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct callsite *sites = NULL, *c;
+	size_t nr_sites = 0, alloc_sites = 0, i, n, kept = 0, dropped = 0;
+	struct elf_file *files;
+	struct db_header hdr;
+	FILE *in, *out;
+	bool mix128;
+	int a;
+
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s OLD_DB NEW_DB FILE...\n", argv[0]);
+		return 1;
+	}
+
+	in = fopen(argv[1], "r");
+	if (!in) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (!read_all(in, &hdr, sizeof(hdr)) ||
+	    memcmp(hdr.magic, DB_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.hash_scheme > HASH_MIX128) {
+		fprintf(stderr, "%s: not a database\n", argv[1]);
+		return 1;
+	}
+
+	if (hdr.callsite_id != CALLSITE_ID_SYMBOL ||
+	    !(hdr.flags & DB_VERIFY_CALLSITES) ||
+	    hdr.flags & (DB_THREAD_ORIGIN | DB_THREAD_ROLE |
+			 DB_FIBER_ORIGIN)) {
+		fprintf(stderr, "%s: only databases identifying call-sites "
+			"by symbol and recorded with FAILINJ_VERIFY_CALLSITES "
+			"can be migrated\n", argv[1]);
+		return 1;
+	}
+
+	files = xrealloc(NULL, (argc - 3) * sizeof(*files));
+	memset(files, 0, (argc - 3) * sizeof(*files));
+	for (a = 3; a < argc; a++) {
+		files[a - 3].path = argv[a];
+		elf_load(&files[a - 3]);
+	}
+
+	/* the same function may be in both the symtab and dynsym */
+	qsort(funcs, nr_funcs, sizeof(*funcs), cmp_function);
+	for (i = 0, n = 0; i < nr_funcs; i++)
+		if (!n || cmp_function(&funcs[i], &funcs[n - 1]))
+			funcs[n++] = funcs[i];
+	nr_funcs = n;
+
+	crc32c_hash = crc32c_kernel(false);
+	mix128 = hdr.hash_scheme == HASH_MIX128;
+
+	while (1) {
+		if (nr_sites == alloc_sites) {
+			alloc_sites = alloc_sites ? alloc_sites * 2 : 256;
+			sites = xrealloc(sites, alloc_sites * sizeof(*sites));
+		}
+
+		c = &sites[nr_sites];
+		if (!read_all(in, &c->hash, sizeof(c->hash)))
+			break;
+
+		if ((mix128 && !read_all(in, &c->hash_hi, sizeof(c->hash_hi))) ||
+		    !read_all(in, &c->nr, sizeof(c->nr)) || c->nr > MAX_FRAMES) {
+			fprintf(stderr, "%s: database is corrupt\n", argv[1]);
+			return 1;
+		}
+
+		c->keys = xrealloc(NULL, c->nr * 2 * sizeof(*c->keys));
+		if (!read_all(in, c->keys, c->nr * 2 * sizeof(*c->keys))) {
+			fprintf(stderr, "%s: database is corrupt\n", argv[1]);
+			return 1;
+		}
+
+		if (!migrate_frames(c->keys, c->nr)) {
+			free(c->keys);
+			dropped++;
+			continue;
+		}
+
+		hash_callsite(c, hdr.hash_scheme);
+		nr_sites++;
+	}
+	fclose(in);
+
+	/* call-sites on the same line become one */
+	qsort(sites, nr_sites, sizeof(*sites), cmp_callsite);
+
+	out = fopen(argv[2], "w");
+	if (!out) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	hdr.callsite_id = CALLSITE_ID_LINE;
+	write_all(out, &hdr, sizeof(hdr), argv[2]);
+
+	for (i = 0; i < nr_sites; i++) {
+		c = &sites[i];
+		if (i && !cmp_callsite(c, &sites[i - 1]))
+			continue;
+
+		write_all(out, &c->hash, sizeof(c->hash), argv[2]);
+		if (mix128)
+			write_all(out, &c->hash_hi, sizeof(c->hash_hi), argv[2]);
+		write_all(out, &c->nr, sizeof(c->nr), argv[2]);
+		write_all(out, c->keys, c->nr * 2 * sizeof(*c->keys), argv[2]);
+		kept++;
+	}
+
+	if (fclose(out)) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	printf("Migrated %zu call-sites, dropped %zu with ambiguous names\n",
+	       kept, dropped);
+	return 0;
+}
@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: MIT
+/* Copyright (C) 2026, The libfailinj contributors */
+
+/*
+ * Shadow call stack for libfailinj.
+ *
+ * Link this into a program built with -finstrument-functions. libfailinj
+ * finds failinj_shadow_context() through the program's symbol table, so
+ * -rdynamic is only needed if the binary gets stripped.
+ *
+ * The function entry and exit hooks keep a per-thread hash of the chain
+ * of calls leading to the current function, updated incrementally, so
+ * libfailinj can identify a call-site without unwinding the stack.
+ *
+ * Each entry mixes the called function and the call-site, both as
+ * offsets from the start of the module this file is linked into, into
+ * the hash of the caller. Call-sites outside of the module (such as
+ * the call to main() from libc) only contribute the function. Calls
+ * nested deeper than SHADOW_MAX_DEPTH all share the hash at that depth.
+ * Leaving functions by longjmp() is not tracked.
+ */
+
+#include <stdint.h>
+
+#define SHADOW_MAX_DEPTH 1024
+
+#define NO_INSTRUMENT __attribute__((no_instrument_function))
+
+/* Defined by the linker at the start and end of this module's image */
+extern const char __ehdr_start[] __attribute__((weak, visibility("hidden")));
+extern const char _end[] __attribute__((weak, visibility("hidden")));
+
+static __thread unsigned long long shadow_hash[SHADOW_MAX_DEPTH];
+static __thread int shadow_depth;
+
+NO_INSTRUMENT
+static unsigned long long mix(unsigned long long h, unsigned long long w)
+{
+	h ^= w * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+NO_INSTRUMENT
+static unsigned long long module_offset(void *addr)
+{
+	uintptr_t off = (uintptr_t)addr - (uintptr_t)__ehdr_start;
+
+	if (off >= (uintptr_t)_end - (uintptr_t)__ehdr_start)
+		return 0;
+
+	return off;
+}
+
+NO_INSTRUMENT
+void __cyg_profile_func_enter(void *this_fn, void *call_site)
+{
+	unsigned long long h = 0;
+	int depth = shadow_depth;
+
+	if (depth > SHADOW_MAX_DEPTH)
+		depth = SHADOW_MAX_DEPTH;
+	if (depth)
+		h = shadow_hash[depth - 1];
+
+	if (shadow_depth < SHADOW_MAX_DEPTH) {
+		h = mix(h, module_offset(this_fn));
+		shadow_hash[shadow_depth] = mix(h, module_offset(call_site));
+	}
+
+	shadow_depth++;
+}
+
+NO_INSTRUMENT
+void __cyg_profile_func_exit(void *this_fn, void *call_site)
+{
+	if (shadow_depth)
+		shadow_depth--;
+}
+
+/* The hash of the current thread's call stack, 0 outside any function */
+NO_INSTRUMENT
+unsigned long long failinj_shadow_context(void)
+{
+	int depth = shadow_depth;
+
+	if (!depth)
+		return 0;
+	if (depth > SHADOW_MAX_DEPTH)
+		depth = SHADOW_MAX_DEPTH;
+
+	return shadow_hash[depth - 1];
+}
@@ -0,0 +1,237 @@
+// SPDX-License-Identifier: MIT
+/* Copyright (C) 2026, The libfailinj contributors */
+
+/*
+ * Turn the raw backtraces libfailinj writes with FAILINJ_RAW_BACKTRACES
+ * into the same symbolic backtraces it would otherwise have printed.
+ *
+ * Usage: failinj-symbolize [FILE]
+ *
+ * The log is read from FILE, or stdin, and each backtrace is printed
+ * after its message. Addresses are resolved using the symbol tables of
+ * the files the recorded modules were loaded from, just as the library
+ * does. If a file's build-id no longer matches the one recorded, it has
+ * been rebuilt since, so its frames are printed as a path and offset.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "failinj-elf.h"
+
+struct elf_file {
+	char *path;
+	unsigned long long id;
+	const char *names;
+	struct symbol *syms;
+	size_t nr_syms;
+	size_t alloc_syms;
+	struct elf_file *next;
+};
+
+struct module {
+	unsigned long base;
+	unsigned long start;
+	unsigned long end;
+	struct elf_file *file;
+};
+
+struct process {
+	int pid;
+	struct module *modules;
+	int nr_modules;
+	int alloc_modules;
+	struct process *next;
+};
+
+static struct elf_file *files;
+static struct process *processes;
+
+static void *xrealloc(void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (!p) {
+		perror("failinj-symbolize");
+		exit(1);
+	}
+
+	return p;
+}
+
+static void add_function(void *data, const ElfW(Sym) *sym, uint64_t name)
+{
+	struct elf_file *f = data;
+
+	if (name > UINT32_MAX)
+		return;
+
+	if (f->nr_syms == f->alloc_syms) {
+		f->alloc_syms = f->alloc_syms ? f->alloc_syms * 2 : 256;
+		f->syms = xrealloc(f->syms, f->alloc_syms * sizeof(*f->syms));
+	}
+
+	f->syms[f->nr_syms].off = sym->st_value;
+	f->syms[f->nr_syms].name = name;
+	f->syms[f->nr_syms].seq = f->nr_syms;
+	f->nr_syms++;
+}
+
+/*
+ * Collect the functions in the file's symbol tables the same way
+ * libfailinj does. The file stays mapped as the names point into it.
+ */
+static void elf_load(struct elf_file *f)
+{
+	unsigned long long id;
+	struct elf_image e;
+
+	if (!elf_open(&e, f->path))
+		return;
+
+	if (elf_build_id(&e, &id) && id != f->id) {
+		fprintf(stderr, "%s: build-id does not match the recorded one\n",
+			f->path);
+		elf_close(&e);
+		return;
+	}
+
+	f->names = e.map;
+	elf_for_each_function(&e, add_function, f);
+	f->nr_syms = symbols_sort(f->syms, f->nr_syms);
+}
+
+static struct elf_file *get_file(const char *path, unsigned long long id)
+{
+	struct elf_file *f;
+
+	for (f = files; f; f = f->next)
+		if (f->id == id && !strcmp(f->path, path))
+			return f;
+
+	f = xrealloc(NULL, sizeof(*f));
+	memset(f, 0, sizeof(*f));
+	f->path = strdup(path);
+	f->id = id;
+	f->next = files;
+	files = f;
+
+	elf_load(f);
+	return f;
+}
+
+static struct process *get_process(int pid)
+{
+	struct process *p;
+
+	for (p = processes; p; p = p->next)
+		if (p->pid == pid)
+			return p;
+
+	p = xrealloc(NULL, sizeof(*p));
+	memset(p, 0, sizeof(*p));
+	p->pid = pid;
+	p->next = processes;
+	processes = p;
+
+	return p;
+}
+
+static void print_frame(const struct process *p, unsigned long ip)
+{
+	const struct module *m = NULL;
+	const struct symbol *sym;
+	int i;
+
+	for (i = 0; i < p->nr_modules; i++) {
+		if (ip - 1 >= p->modules[i].start && ip - 1 < p->modules[i].end) {
+			m = &p->modules[i];
+			break;
+		}
+	}
+
+	if (!m) {
+		printf("    ?unknown\n");
+		return;
+	}
+
+	sym = symbols_find(m->file->syms, m->file->nr_syms, ip - 1 - m->base);
+	if (sym)
+		printf("    %s+0x%lx\n", m->file->names + sym->name,
+		       ip - (m->base + sym->off));
+	else
+		printf("    %s+0x%lx\n", m->file->path, ip - m->base);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long base, start, end, ip;
+	unsigned long long id;
+	char *line = NULL, *rest;
+	struct process *p;
+	size_t len = 0;
+	int pid, n, nr, i;
+	FILE *in = stdin;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [FILE]\n", argv[0]);
+		return 1;
+	}
+
+	if (argc == 2) {
+		in = fopen(argv[1], "r");
+		if (!in) {
+			perror(argv[1]);
+			return 1;
+		}
+	}
+
+	while (getline(&line, &len, in) != -1) {
+		line[strcspn(line, "\n")] = 0;
+
+		if (sscanf(line, "modules %d %d", &pid, &nr) == 2) {
+			p = get_process(pid);
+			p->modules = xrealloc(p->modules,
+					      nr * sizeof(*p->modules));
+			p->nr_modules = 0;
+			p->alloc_modules = nr;
+		} else if (sscanf(line, "module %d %llx %lx %lx %lx %n", &pid,
+				  &id, &base, &start, &end, &n) == 5) {
+			p = get_process(pid);
+			if (p->nr_modules == p->alloc_modules) {
+				fprintf(stderr, "Unexpected module: %s\n", line);
+				return 1;
+			}
+
+			p->modules[p->nr_modules].base = base;
+			p->modules[p->nr_modules].start = start;
+			p->modules[p->nr_modules].end = end;
+			p->modules[p->nr_modules].file = get_file(line + n, id);
+			p->nr_modules++;
+		} else if (sscanf(line, "trace %d %d %n", &pid, &nr, &n) == 2) {
+			p = get_process(pid);
+			rest = line + n;
+			printf("\n%s\n", rest);
+
+			for (i = 0; i < nr; i++) {
+				if (getline(&line, &len, in) == -1 ||
+				    sscanf(line, "%lx", &ip) != 1) {
+					fprintf(stderr, "Truncated backtrace\n");
+					return 1;
+				}
+				print_frame(p, ip);
+			}
+		} else {
+			fprintf(stderr, "Unrecognized line: %s\n", line);
+			return 1;
+		}
+	}
+
+	free(line);
+	return 0;
+}
@@ -30,17 +30,32 @@
 #include <libunwind.h>
 
 #include <dlfcn.h>
+#include <elf.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <link.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/auxv.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <ucontext.h>
+
+/* <unistd.h> would conflict with the definition of syscall() below */
+int close(int fd);
+pid_t getpid(void);
+
+#include "failinj-db.h"
+#include "failinj-elf.h"
+#include "failinj-hash.h"
+#include "failinj-lines.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -54,124 +69,373 @@
 #define TAG "\n" SNAME ": "
 #define PFX SNAME "_"
 
-static volatile bool use_early_allocator;
-static bool force_libc;
+/*
+ * Set while the library looks up a libc function with dlsym(), which
+ * may allocate. Only that thread's allocations come from the early
+ * allocator; another thread's would later reach libc's free().
+ */
+static __thread __attribute__((tls_model("initial-exec")))
+	volatile bool use_early_allocator;
+
+/*
+ * Set while the library itself is calling into libc so that those calls
+ * are passed straight through. It is per thread: other threads keep
+ * being tracked and the tables they touch have locks of their own.
+ */
+static volatile __thread __attribute__((tls_model("initial-exec")))
+	bool force_libc;
 static bool found_bug;
 static bool has_injected_failure;
 static bool failed;
 
 struct hash_entry {
 	unsigned long long hash;
-	char *backtrace;
-	struct hash_entry *next;
+	unsigned long long hash_hi;
+	unsigned long long *keys;
+	int nr_frames;
+};
+
+/* Where a tracked resource was created, kept in the stack depot */
+struct backtrace {
+	unsigned int id;
+	int nr;
+	unw_word_t ips[];
 };
 
-#define HASH_TABLE_SIZE 1024
-#define HASH_TABLE_MASK (HASH_TABLE_SIZE - 1)
-static pthread_mutex_t hash_table_mutex = PTHREAD_MUTEX_INITIALIZER;
-static struct hash_entry *callsite_table[HASH_TABLE_SIZE];
-static struct hash_entry *allocation_table[HASH_TABLE_SIZE];
-static struct hash_entry *fd_table[HASH_TABLE_SIZE];
-static struct hash_entry *file_table[HASH_TABLE_SIZE];
-static struct hash_entry *ferror_table[HASH_TABLE_SIZE];
+#define MAX_FRAMES 256
+#define OWN_FRAMES_SLACK 16
 
 /*
- * Simple hash function based on
- *  http://www.cse.yorku.ca/~oz/hash.html
+ * The library's own metadata (call-site entries, stack records, tables
+ * and symbol tables) is kept out of the program's heap. It comes from a
+ * private arena of anonymous mappings: small blocks are carved out of
+ * 2MB chunks by size class and recycled through a free list per class,
+ * larger ones get a mapping of their own. Each block is preceded by a
+ * word holding its class, or the size of its mapping. The chunks are
+ * only given back, all at once, when the process exits. Blocks are
+ * always zeroed.
+ *
+ * These must be called with force_libc set as the mappings are made
+ * through the intercepted mmap() and munmap(). They return NULL when
+ * out of memory and leave bailing out to the caller, which may have
+ * locks to drop first.
  */
-#define HASH_INIT 53815381
-static unsigned long long djb_hash(const char *inp, unsigned long long hash)
-{
-	while(*inp)
-		hash = (hash * 33) ^ *inp++;
+#define ARENA_CHUNK_SIZE (2UL << 20)
+#define ARENA_HDR sizeof(size_t)
 
-	return hash;
-}
+static const size_t arena_classes[] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048,
+	3072, 4096,
+};
+
+static pthread_mutex_t arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void *arena_free_lists[ARRAY_SIZE(arena_classes)];
+static char *arena_pos, *arena_end;
+static int arena_huge_pages = -1;
 
 /*
- * Insert into a hash table, return 0 if the element already
- * exists, 1 if it was inserted.
+ * With FAILINJ_HUGE_PAGES set, mappings of a chunk or more are aligned
+ * to 2MB so that they can be backed by transparent huge pages.
  */
-static int hash_table_insert(struct hash_entry *n, struct hash_entry **table)
+static void *arena_map(size_t size)
 {
-	struct hash_entry **slot;
-	int ret = 1;
+	char *p, *aligned;
+	size_t len = size;
 
-	pthread_mutex_lock(&hash_table_mutex);
+	if (arena_huge_pages < 0)
+		arena_huge_pages = getenv(PFX "HUGE_PAGES") != NULL;
 
-	slot = &table[n->hash & HASH_TABLE_MASK];
+	if (arena_huge_pages && size >= ARENA_CHUNK_SIZE)
+		len += ARENA_CHUNK_SIZE;
 
-	while (*slot) {
-		if ((*slot)->hash == n->hash) {
-			ret = 0;
-			goto out;
-		}
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	if (len == size)
+		return p;
+
+	aligned = (char *)(((uintptr_t)p + ARENA_CHUNK_SIZE - 1) &
+			   ~(ARENA_CHUNK_SIZE - 1));
+	if (aligned > p)
+		munmap(p, aligned - p);
+	if (p + len > aligned + size)
+		munmap(aligned + size, p + len - (aligned + size));
+
+	madvise(aligned, size, MADV_HUGEPAGE);
+	return aligned;
+}
+
+static void *meta_alloc(size_t size)
+{
+	size_t *hdr, len, page;
+	unsigned int c;
+	char *chunk;
 
-                if ((*slot)->hash > n->hash)
+	size += ARENA_HDR;
+	for (c = 0; c < ARRAY_SIZE(arena_classes); c++)
+		if (arena_classes[c] >= size)
 			break;
 
-		slot = &((*slot)->next);
+	if (c == ARRAY_SIZE(arena_classes)) {
+		page = getauxval(AT_PAGESZ);
+		len = (size + page - 1) & ~(page - 1);
+		hdr = arena_map(len);
+		if (!hdr)
+			return NULL;
+
+		*hdr = len;
+		return hdr + 1;
 	}
 
-	n->next = *slot;
-	*slot = n;
+	pthread_mutex_lock(&arena_mutex);
 
-out:
-	pthread_mutex_unlock(&hash_table_mutex);
-	return ret;
+	hdr = arena_free_lists[c];
+	if (hdr) {
+		arena_free_lists[c] = *(void **)hdr;
+		memset(hdr, 0, arena_classes[c]);
+	} else {
+		if (arena_end - arena_pos < arena_classes[c]) {
+			chunk = arena_map(ARENA_CHUNK_SIZE);
+			if (!chunk) {
+				pthread_mutex_unlock(&arena_mutex);
+				return NULL;
+			}
+
+			arena_pos = chunk;
+			arena_end = chunk + ARENA_CHUNK_SIZE;
+		}
+
+		hdr = (size_t *)arena_pos;
+		arena_pos += arena_classes[c];
+	}
+
+	pthread_mutex_unlock(&arena_mutex);
+
+	*hdr = c;
+	return hdr + 1;
 }
 
-static struct hash_entry **__hash_table_find(unsigned long long hash,
-					     struct hash_entry **table)
+static void meta_free(void *p)
 {
-	struct hash_entry **slot;
+	size_t *hdr = (size_t *)p - 1;
+	unsigned int c;
+
+	if (!p)
+		return;
 
-	slot = &table[hash & HASH_TABLE_MASK];
+	if (*hdr >= ARRAY_SIZE(arena_classes)) {
+		munmap(hdr, *hdr);
+		return;
+	}
 
-	while (*slot) {
-		if ((*slot)->hash == hash)
-			return slot;
+	c = *hdr;
+	pthread_mutex_lock(&arena_mutex);
+	*(void **)hdr = arena_free_lists[c];
+	arena_free_lists[c] = hdr;
+	pthread_mutex_unlock(&arena_mutex);
+}
 
-		if ((*slot)->hash > hash)
-			return NULL;
+static void *meta_realloc(void *p, size_t size)
+{
+	size_t *hdr = (size_t *)p - 1, avail;
+	void *new;
+
+	if (!p)
+		return meta_alloc(size);
+
+	if (*hdr >= ARRAY_SIZE(arena_classes))
+		avail = *hdr - ARENA_HDR;
+	else
+		avail = arena_classes[*hdr] - ARENA_HDR;
+
+	if (size <= avail)
+		return p;
+
+	new = meta_alloc(size);
+	if (!new)
+		return NULL;
+
+	memcpy(new, p, avail);
+	meta_free(p);
+	return new;
+}
+
+/*
+ * Open addressing hash table with linear probing. The keys are kept in
+ * a dense array of their own and the values (such as the backtraces of
+ * tracked resources) in a second one, which is only
+ * touched once a key has matched. Zero marks an empty slot so it cannot
+ * be used as a key. The table doubles when it becomes 3/4 full and
+ * halves when it drops below 1/8; removals shift the rest of the probe
+ * sequence back rather than leaving tombstones. Each table has its own
+ * lock and sits in its own cache lines.
+ */
+struct hash_table {
+	pthread_mutex_t lock;
+	unsigned long long *keys;
+	void **values;
+	size_t size;
+	size_t nr;
+} __attribute__((aligned(64)));
+
+#define HASH_TABLE_MIN_SIZE 64
+#define HASH_TABLE_INIT { .lock = PTHREAD_MUTEX_INITIALIZER }
+
+/*
+ * The tables tracking resources are split into shards by the top bits
+ * of the key's hash, the bottom ones picking the slot within a shard,
+ * so threads working on unrelated pointers rarely contend.
+ */
+#define SHARD_BITS 6
+#define NR_SHARDS (1 << SHARD_BITS)
+#define SHARDS_INIT { [0 ... NR_SHARDS - 1] = HASH_TABLE_INIT }
+
+static struct hash_table allocation_table[NR_SHARDS] = SHARDS_INIT;
+static struct hash_table file_table[NR_SHARDS] = SHARDS_INIT;
+static struct hash_table ferror_table[NR_SHARDS] = SHARDS_INIT;
+
+static size_t hash_table_slot(const struct hash_table *t,
+			      unsigned long long key)
+{
+	return fmix64(key) & (t->size - 1);
+}
+
+static unsigned int shard_index(unsigned long long key)
+{
+	return fmix64(key) >> (64 - SHARD_BITS);
+}
+
+static struct hash_table *hash_shard(struct hash_table *shards,
+				     unsigned long long key)
+{
+	return &shards[shard_index(key)];
+}
 
-		slot = &((*slot)->next);
+static void hash_table_resize(struct hash_table *t, size_t size);
+
+/*
+ * The functions below must be called with the table's lock held and,
+ * except for finding, with force_libc set as they may resize the table.
+ */
+
+/* Add an entry without checking whether the key is already there */
+static void __hash_table_add(struct hash_table *t, unsigned long long key,
+			     void *value)
+{
+	size_t i;
+
+	if ((t->nr + 1) * 4 > t->size * 3)
+		hash_table_resize(t, t->size ? t->size * 2 :
+				  HASH_TABLE_MIN_SIZE);
+
+	for (i = hash_table_slot(t, key); t->keys[i];
+	     i = (i + 1) & (t->size - 1))
+		;
+
+	t->keys[i] = key;
+	t->values[i] = value;
+	t->nr++;
+}
+
+/* Returns the slot holding the key, or -1 */
+static ssize_t __hash_table_find(const struct hash_table *t,
+				 unsigned long long key)
+{
+	size_t i;
+
+	if (!t->nr)
+		return -1;
+
+	for (i = hash_table_slot(t, key); t->keys[i];
+	     i = (i + 1) & (t->size - 1))
+		if (t->keys[i] == key)
+			return i;
+
+	return -1;
+}
+
+static void __hash_table_remove(struct hash_table *t, size_t i)
+{
+	size_t mask = t->size - 1, j, home;
+
+	for (j = (i + 1) & mask; t->keys[j]; j = (j + 1) & mask) {
+		/* move back entries whose probe sequence passes through i */
+		home = hash_table_slot(t, t->keys[j]);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			t->keys[i] = t->keys[j];
+			t->values[i] = t->values[j];
+			i = j;
+		}
 	}
 
-	return NULL;
+	t->keys[i] = 0;
+	t->nr--;
+
+	if (t->size > HASH_TABLE_MIN_SIZE && t->nr * 8 < t->size)
+		hash_table_resize(t, t->size / 2);
 }
 
-static struct hash_entry *hash_table_find(unsigned long long hash,
-					  struct hash_entry **table)
+/* Empty the table, the values are not owned by it */
+static void __hash_table_clear(struct hash_table *t)
 {
-	struct hash_entry **slot, *ret = NULL;
+	meta_free(t->keys);
+	meta_free(t->values);
+	t->keys = NULL;
+	t->values = NULL;
+	t->size = 0;
+	t->nr = 0;
+}
 
-	pthread_mutex_lock(&hash_table_mutex);
-	slot = __hash_table_find(hash, table);
-	if (slot)
-		ret = *slot;
-	pthread_mutex_unlock(&hash_table_mutex);
+/* Insert unless the key is already there, returns whether it was */
+static bool hash_table_insert(struct hash_table *t, unsigned long long key,
+			      void *value)
+{
+	bool ret;
+
+	pthread_mutex_lock(&t->lock);
+	ret = __hash_table_find(t, key) < 0;
+	if (ret)
+		__hash_table_add(t, key, value);
+	pthread_mutex_unlock(&t->lock);
 
 	return ret;
 }
 
-static struct hash_entry *hash_table_pop(unsigned long long hash,
-					 struct hash_entry **table)
+static bool hash_table_find(struct hash_table *t, unsigned long long key)
 {
-	struct hash_entry **slot, *ret = NULL;
+	bool ret;
 
-	pthread_mutex_lock(&hash_table_mutex);
-	slot = __hash_table_find(hash, table);
-	if (slot) {
-		ret = *slot;
-		*slot = ret->next;
-	}
-	pthread_mutex_unlock(&hash_table_mutex);
+	pthread_mutex_lock(&t->lock);
+	ret = __hash_table_find(t, key) >= 0;
+	pthread_mutex_unlock(&t->lock);
 
 	return ret;
 }
 
-static void __exit_error(const char *env, int err)
+/*
+ * Remove a key, returns whether it was there. Its value is stored in
+ * *value if that is not NULL.
+ */
+static bool hash_table_pop(struct hash_table *t, unsigned long long key,
+			   void **value)
+{
+	ssize_t i;
+
+	pthread_mutex_lock(&t->lock);
+	i = __hash_table_find(t, key);
+	if (i >= 0) {
+		if (value)
+			*value = t->values[i];
+		__hash_table_remove(t, i);
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return i >= 0;
+}
+
+static void __attribute__((noreturn)) __exit_error(const char *env, int err)
 {
 	const char *errstr = getenv(env);
 	char *end;
@@ -195,86 +459,311 @@ static void __exit_error(const char *env, int err)
 }
 /* LCOV_EXCL_STOP */
 
-static void exit_error(void)
+static void __attribute__((noreturn)) exit_error(void)
 {
 	failed = true;
 	__exit_error(PFX "EXIT_ERROR", 32);
 }
 
+/*
+ * Buffers needed to handle an intercepted call, too large to keep on
+ * the stack of the thread making it, which may be a small fiber stack.
+ * Each thread gets its own set from the arena the first time it needs
+ * them. They are only used with force_libc set, so an intercepted call
+ * made from within never gets to them, except for ips: that holds the
+ * captured stack of the owner for as long as the interposed function
+ * runs. A signal handler may take it over in between, in which case
+ * the owner just unwinds again.
+ *
+ * The sets of all threads are kept on a list so that the snapshot of
+ * the module map each thread is reading (see map_enter()) can be
+ * checked before an old one is freed.
+ */
+struct scratch {
+	struct scratch *next;
+	struct scratch *prev;
+	struct module_map *map;
+	int map_depth;
+	const struct stack *owner;
+	unw_word_t ips[MAX_FRAMES];
+	void *buf[MAX_FRAMES];
+	unsigned long long keys[2 * MAX_FRAMES];
+	unw_word_t collapsed[MAX_FRAMES];
+	char name[4096];
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 8];
+	unw_cursor_t cursor;
+	unw_context_t uc;
+};
+
+static __thread __attribute__((tls_model("initial-exec")))
+	struct scratch *scratch;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t scratch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct scratch *scratch_list;
+
+static void scratch_free(void *p)
+{
+	bool last_force_libc = force_libc;
+	struct scratch *sc = p;
+
+	pthread_mutex_lock(&scratch_mutex);
+	if (sc->prev)
+		sc->prev->next = sc->next;
+	else
+		scratch_list = sc->next;
+	if (sc->next)
+		sc->next->prev = sc->prev;
+	pthread_mutex_unlock(&scratch_mutex);
+
+	force_libc = true;
+	if (scratch == sc)
+		scratch = NULL;
+	meta_free(sc);
+	force_libc = last_force_libc;
+}
+
+static void scratch_init(void)
+{
+	pthread_key_create(&scratch_key, scratch_free);
+}
+
+static struct scratch *get_scratch(void)
+{
+	bool last_force_libc = force_libc;
+
+	if (scratch)
+		return scratch;
+
+	force_libc = true;
+	scratch = meta_alloc(sizeof(*scratch));
+	if (!scratch) {
+		perror(SNAME);
+		exit_error();
+	}
+
+	/* the key's destructor gives the buffers back when the thread exits */
+	pthread_once(&scratch_once, scratch_init);
+	pthread_setspecific(scratch_key, scratch);
+
+	pthread_mutex_lock(&scratch_mutex);
+	scratch->next = scratch_list;
+	if (scratch_list)
+		scratch_list->prev = scratch;
+	scratch_list = scratch;
+	pthread_mutex_unlock(&scratch_mutex);
+	force_libc = last_force_libc;
+
+	return scratch;
+}
+
 static struct hash_entry *create_hash_entry(void)
 {
 	struct hash_entry *h;
 
-	h = malloc(sizeof(*h));
+	h = meta_alloc(sizeof(*h));
 	if (!h) {
 		perror(SNAME);
 		exit_error();
 	}
 
-	h->next = NULL;
-	h->backtrace = NULL;
+	h->keys = NULL;
+	h->nr_frames = 0;
 	h->hash = HASH_INIT;
+	h->hash_hi = 0;
 
 	return h;
 }
 
-static FILE *load_database(void)
+/*
+ * Called with the table's lock held, which is released before bailing
+ * out as the leak checks at exit take it again.
+ */
+static void hash_table_resize(struct hash_table *t, size_t size)
 {
-	const char *fname = getenv(PFX "DATABASE");
-	struct hash_entry *h;
-	size_t read;
-	FILE *dbf;
-	int ret;
-
-	if (!fname)
-		fname = "failinj.db";
+	unsigned long long *keys = t->keys;
+	void **values = t->values;
+	size_t i, j, old_size = t->size;
 
-	dbf = fopen(fname, "a+b");
-	if (!dbf) {
-		fprintf(stderr, TAG "Unable to open '%s': %m\n", fname);
+	t->keys = meta_alloc(size * sizeof(*t->keys));
+	t->values = meta_alloc(size * sizeof(*t->values));
+	if (!t->keys || !t->values) {
+		perror(SNAME);
+		meta_free(t->keys);
+		meta_free(t->values);
+		t->keys = keys;
+		t->values = values;
+		pthread_mutex_unlock(&t->lock);
 		exit_error();
 	}
 
-	h = create_hash_entry();
+	t->size = size;
+	for (i = 0; i < old_size; i++) {
+		if (!keys[i])
+			continue;
 
-	while (1) {
-		read = fread(&h->hash, sizeof(h->hash), 1, dbf);
-		if (ferror(dbf)) {
-			perror(TAG "Unable to read database");
-			exit_error();
-		}
+		for (j = hash_table_slot(t, keys[i]); t->keys[j];
+		     j = (j + 1) & (size - 1))
+			;
 
-		if (read != 1)
-			break;
+		t->keys[j] = keys[i];
+		t->values[j] = values[i];
+	}
 
-		ret = hash_table_insert(h, callsite_table);
-		if (ret)
-			h = create_hash_entry();
+	meta_free(keys);
+	meta_free(values);
+}
 
-		/*
-		 * break if we see multiple zero hashes, this is for testing
-		 * with /dev/full which outputs a stream of zeros
-		 */
-		if (!ret && h->hash == 0)
-			break;
+/*
+ * Settings which change the contents of the database. A new database
+ * takes them from the environment and records them in its header, an
+ * existing one dictates them.
+ */
+static int callsite_id = -1;
+static int hash_scheme = -1;
+static int verify_callsites = -1;
+static int collapse_cycles = -1;
+static int mix_thread_origin = -1;
+static int mix_thread_role = -1;
+static int mix_fiber_origin = -1;
+static hash_words_fn *hash_words;
+static unsigned long callsite_collisions;
+
+/*
+ * Programs built with -finstrument-functions and failinj-shadow.c keep
+ * a hash of their call stack up to date as they go, so a call-site can
+ * be identified without unwinding at all. Set by find_shadow_stack().
+ */
+static unsigned long long (*shadow_context)(void);
+static unsigned long merged_stacks;
+
+static int env_callsite_id(void)
+{
+	const char *env = getenv(PFX "CALLSITE_ID");
+
+	if (!env)
+		return -1;
+
+	if (!strcmp(env, "build-id"))
+		return CALLSITE_ID_BUILD_ID;
+	if (!strcmp(env, "shadow"))
+		return CALLSITE_ID_SHADOW;
+	if (!strcmp(env, "line"))
+		return CALLSITE_ID_LINE;
+	if (!strcmp(env, "symbol"))
+		return CALLSITE_ID_SYMBOL;
+
+	fprintf(stderr, TAG "Unknown %sCALLSITE_ID: %s\n", PFX, env);
+	exit_error();
+}
+
+static int env_hash_scheme(void)
+{
+	const char *env = getenv(PFX "HASH");
+
+	if (!env)
+		return -1;
+
+	if (!strcmp(env, "crc32c") || !strcmp(env, "crc32c-generic"))
+		return HASH_CRC32C;
+	if (!strcmp(env, "mix128"))
+		return HASH_MIX128;
+	if (!strcmp(env, "djb"))
+		return HASH_DJB;
+
+	fprintf(stderr, TAG "Unknown %sHASH: %s\n", PFX, env);
+	exit_error();
+}
+
+static int env_verify_callsites(void)
+{
+	return getenv(PFX "VERIFY_CALLSITES") ? 1 : -1;
+}
+
+static int env_thread_origin(void)
+{
+	return getenv(PFX "THREAD_ORIGIN") ? 1 : -1;
+}
+
+static int env_thread_role(void)
+{
+	return getenv(PFX "THREAD_ROLE") ? 1 : -1;
+}
+
+static int env_fiber_origin(void)
+{
+	return getenv(PFX "FIBER_ORIGIN") ? 1 : -1;
+}
+
+static int env_collapse_cycles(void)
+{
+	const char *env = getenv(PFX "COLLAPSE_RECURSION");
+	int cycles;
+
+	if (!env)
+		return -1;
+
+	cycles = atoi(env);
+	if (cycles < 0)
+		return 0;
+	if (cycles > MAX_FRAMES / 2)
+		return MAX_FRAMES / 2;
+
+	return cycles;
+}
+
+static void set_db_setting(int *setting, int env, int stored, int def,
+			   const char *name)
+{
+	if (stored < 0) {
+		*setting = env < 0 ? def : env;
+		return;
 	}
 
-	free(h);
-	return dbf;
+	if (env >= 0 && env != stored) {
+		fprintf(stderr, TAG "%s%s does not match the database\n",
+			PFX, name);
+		exit_error();
+	}
+
+	*setting = stored;
 }
 
-static void write_callsite(FILE *dbf, struct hash_entry *h)
+static bool db_read(FILE *dbf, void *buf, size_t size)
+{
+	size_t read;
+
+	if (!size)
+		return true;
+
+	read = fread(buf, size, 1, dbf);
+	if (ferror(dbf)) {
+		perror(TAG "Unable to read database");
+		exit_error();
+	}
+
+	return read == 1;
+}
+
+static void db_write(FILE *dbf, const void *buf, size_t size)
 {
 	size_t written;
-	int ret;
 
-	written = fwrite(&h->hash, sizeof(h->hash), 1, dbf);
+	if (!size)
+		return;
+
+	written = fwrite(buf, size, 1, dbf);
 	if (written != 1) {
 		perror(TAG "Unable to write database");
 		exit_error();
 	}
+}
+
+static void db_flush(FILE *dbf)
+{
+	int ret;
 
-	/* flush in case the program crashes in the error handler */
 	ret = fflush(dbf);
 	if (ret == EOF) {
 		perror(TAG "Unable to write database");
@@ -282,216 +771,2498 @@ static void write_callsite(FILE *dbf, struct hash_entry *h)
 	}
 }
 
-static struct hash_entry *get_current_callsite(void)
+static unsigned long long context_key(void);
+
+/*
+ * Databases from before the header in failinj-db.h existed hold nothing
+ * but 64-bit djb hashes of stacks that still included the library's own
+ * frames and everything below main(), so none of them can match a
+ * call-site now. Those are refused rather than silently tested afresh,
+ * as are those with the first version of the header, which did not
+ * record the context settings.
+ */
+static void read_db_header(FILE *dbf)
 {
-	char *skip = getenv(PFX "SKIP_INJECTION");
-	struct hash_entry *h = create_hash_entry();
-	unw_cursor_t cursor;
-	unw_context_t uc;
-	unw_word_t off;
-	char name[4096];
-	int ret;
+	struct db_header hdr = {};
+	const char *env;
+	size_t read;
+
+	read = fread(&hdr, 1, sizeof(hdr), dbf);
+	if (ferror(dbf)) {
+		perror(TAG "Unable to read database");
+		exit_error();
+	}
 
-	unw_getcontext(&uc);
-	unw_init_local(&cursor, &uc);
+	if (!read) {
+		set_db_setting(&hash_scheme, env_hash_scheme(), -1, HASH_DJB,
+			       "HASH");
+		set_db_setting(&callsite_id, env_callsite_id(), -1,
+			       shadow_context ? CALLSITE_ID_SHADOW :
+			       CALLSITE_ID_SYMBOL, "CALLSITE_ID");
+		set_db_setting(&verify_callsites, env_verify_callsites(), -1,
+			       0, "VERIFY_CALLSITES");
+		set_db_setting(&collapse_cycles, env_collapse_cycles(), -1,
+			       0, "COLLAPSE_RECURSION");
+		set_db_setting(&mix_thread_origin, env_thread_origin(), -1,
+			       0, "THREAD_ORIGIN");
+		set_db_setting(&mix_thread_role, env_thread_role(), -1,
+			       0, "THREAD_ROLE");
+		set_db_setting(&mix_fiber_origin, env_fiber_origin(), -1,
+			       0, "FIBER_ORIGIN");
+
+		memcpy(hdr.magic, DB_MAGIC, sizeof(hdr.magic));
+		hdr.hash_scheme = hash_scheme;
+		hdr.callsite_id = callsite_id;
+		hdr.flags = verify_callsites ? DB_VERIFY_CALLSITES : 0;
+		hdr.flags |= mix_thread_origin ? DB_THREAD_ORIGIN : 0;
+		hdr.flags |= mix_thread_role ? DB_THREAD_ROLE : 0;
+		hdr.flags |= mix_fiber_origin ? DB_FIBER_ORIGIN : 0;
+		hdr.collapse_cycles = collapse_cycles;
+		hdr.context_key = context_key();
+
+		db_write(dbf, &hdr, sizeof(hdr));
+		db_flush(dbf);
+	} else if (memcmp(hdr.magic, DB_MAGIC, sizeof(hdr.magic))) {
+		fprintf(stderr, TAG "Database has no header: it was created "
+			"by an older version whose call-sites can no longer "
+			"match, remove it to start over\n");
+		exit_error();
+	} else if (read < sizeof(hdr)) {
+		fprintf(stderr, TAG "Database header is truncated, remove it "
+			"to start over\n");
+		exit_error();
+	} else {
+		set_db_setting(&hash_scheme, env_hash_scheme(),
+			       hdr.hash_scheme, HASH_DJB, "HASH");
+		set_db_setting(&callsite_id, env_callsite_id(),
+			       hdr.callsite_id, CALLSITE_ID_SYMBOL,
+			       "CALLSITE_ID");
+		set_db_setting(&verify_callsites, env_verify_callsites(),
+			       !!(hdr.flags & DB_VERIFY_CALLSITES), 0,
+			       "VERIFY_CALLSITES");
+		set_db_setting(&collapse_cycles, env_collapse_cycles(),
+			       hdr.collapse_cycles, 0, "COLLAPSE_RECURSION");
+		set_db_setting(&mix_thread_origin, env_thread_origin(),
+			       !!(hdr.flags & DB_THREAD_ORIGIN), 0,
+			       "THREAD_ORIGIN");
+		set_db_setting(&mix_thread_role, env_thread_role(),
+			       !!(hdr.flags & DB_THREAD_ROLE), 0,
+			       "THREAD_ROLE");
+		set_db_setting(&mix_fiber_origin, env_fiber_origin(),
+			       !!(hdr.flags & DB_FIBER_ORIGIN), 0,
+			       "FIBER_ORIGIN");
+
+		if (hdr.context_key != context_key()) {
+			fprintf(stderr, TAG "%sCONTEXT_DEPTH, the per family "
+				"depths or %sANCHORS do not match the "
+				"database\n", PFX, PFX);
+			exit_error();
+		}
+	}
+
+	if (callsite_id == CALLSITE_ID_SHADOW && !shadow_context) {
+		fprintf(stderr, TAG "Database needs a shadow call stack "
+			"but the program does not provide "
+			"failinj_shadow_context()\n");
+		exit_error();
+	}
 
-	while (unw_step(&cursor) > 0) {
-		ret = unw_get_proc_name(&cursor, name, sizeof(name), &off);
-		if (ret != 0) {
-			strcpy(name, "unknown");
-		} else {
-			if (skip && strstr(skip, name))
-				goto skip;
+	env = getenv(PFX "HASH");
+	if (hash_scheme == HASH_CRC32C)
+		hash_words = crc32c_kernel(env &&
+					   !strcmp(env, "crc32c-generic"));
+}
 
-			if (!strcmp(name, "exit"))
-				goto skip;
+static bool read_callsite(FILE *dbf, struct hash_entry *h)
+{
+	uint32_t nr;
 
-			snprintf(name + strlen(name),
-				 sizeof(name) - strlen(name),
-				 "+0x%lx", off);
-		}
+	if (!db_read(dbf, &h->hash, sizeof(h->hash)))
+		return false;
+
+	if (hash_scheme == HASH_MIX128 &&
+	    !db_read(dbf, &h->hash_hi, sizeof(h->hash_hi)))
+		return false;
+
+	if (!verify_callsites)
+		return true;
+
+	if (!db_read(dbf, &nr, sizeof(nr)))
+		return false;
+
+	if (nr > MAX_FRAMES) {
+		fprintf(stderr, TAG "Database is corrupt\n");
+		exit_error();
+	}
+
+	h->keys = meta_alloc(nr * 2 * sizeof(*h->keys));
+	if (!h->keys) {
+		perror(SNAME);
+		exit_error();
+	}
+
+	h->nr_frames = nr;
+	return db_read(dbf, h->keys, nr * 2 * sizeof(*h->keys));
+}
+
+static void write_callsite(FILE *dbf, struct hash_entry *h)
+{
+	uint32_t nr = h->nr_frames;
+
+	db_write(dbf, &h->hash, sizeof(h->hash));
+
+	if (hash_scheme == HASH_MIX128)
+		db_write(dbf, &h->hash_hi, sizeof(h->hash_hi));
+
+	if (verify_callsites) {
+		db_write(dbf, &nr, sizeof(nr));
+		db_write(dbf, h->keys, nr * 2 * sizeof(*h->keys));
+	}
+
+	/* flush in case the program crashes in the error handler */
+	db_flush(dbf);
+}
+
+static bool same_frames(const struct hash_entry *a,
+			const struct hash_entry *b)
+{
+	if (a->nr_frames != b->nr_frames)
+		return false;
+
+	return !a->nr_frames ||
+		!memcmp(a->keys, b->keys, a->nr_frames * 2 * sizeof(*a->keys));
+}
+
+/*
+ * Call-sites are kept in an insert-only open addressing table which is
+ * looked up without taking any lock, as nearly every call made once a
+ * campaign is under way is from a known call-site. Each slot holds the
+ * low 64 bits of the hash, zero when empty, and the entry, which is
+ * stored first so that it is there for a reader that sees the key.
+ * Insertions are serialized by a mutex. When the table gets 3/4 full,
+ * a copy twice the size is built and published in its place; readers
+ * still probing the old one at worst miss the newest entries and go on
+ * to take the lock. Old tables are kept as they may still be in use.
+ *
+ * Lookups only read the pointer to the table and its slots, which are
+ * kept apart from anything written on the hot path: the pointer has a
+ * cache line of its own and the slots are large enough to get their own
+ * mapping from the arena.
+ */
+struct callsite_slot {
+	unsigned long long key;
+	struct hash_entry *entry;
+};
+
+struct callsite_slots {
+	size_t size;
+	struct callsite_slots *prev;
+	struct callsite_slot slots[];
+};
+
+#define CALLSITE_SET_MIN_SIZE 256
+
+static struct {
+	struct callsite_slots *cur;
+} __attribute__((aligned(64))) callsite_set;
+
+static struct {
+	pthread_mutex_t lock;
+	size_t nr;
+} __attribute__((aligned(64))) callsite_writer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* A hash of zero would mark an empty slot */
+static unsigned long long callsite_key(const struct hash_entry *n)
+{
+	return n->hash ?: 1;
+}
+
+/*
+ * Call-sites are keyed by the low 64 bits of their hash so there may be
+ * several entries for a key. When verifying call-sites, an entry with
+ * the same hash but different frames is a collision and not a match.
+ * Entries are never changed once inserted.
+ */
+static struct hash_entry *__callsite_find(const struct callsite_slots *t,
+					  const struct hash_entry *n,
+					  bool *collision)
+{
+	unsigned long long key = callsite_key(n), k;
+	size_t mask, i;
+	struct hash_entry *e;
+
+	*collision = false;
+	if (!t)
+		return NULL;
+
+	mask = t->size - 1;
+	for (i = fmix64(key) & mask;
+	     (k = __atomic_load_n(&t->slots[i].key, __ATOMIC_ACQUIRE));
+	     i = (i + 1) & mask) {
+		if (k != key)
+			continue;
+
+		e = t->slots[i].entry;
+		if (e->hash != n->hash || e->hash_hi != n->hash_hi)
+			continue;
+
+		if (!verify_callsites || same_frames(e, n))
+			return e;
+
+		*collision = true;
+	}
+
+	return NULL;
+}
+
+static bool callsite_find(const struct hash_entry *n)
+{
+	bool collision;
+
+	return __callsite_find(__atomic_load_n(&callsite_set.cur,
+					       __ATOMIC_ACQUIRE),
+			       n, &collision);
+}
+
+/* Must be called with the writer lock held, slots are published after */
+static void callsite_slots_add(struct callsite_slots *t, struct hash_entry *e)
+{
+	unsigned long long key = callsite_key(e);
+	size_t mask = t->size - 1, i;
+
+	for (i = fmix64(key) & mask; t->slots[i].key; i = (i + 1) & mask)
+		;
+
+	t->slots[i].entry = e;
+	__atomic_store_n(&t->slots[i].key, key, __ATOMIC_RELEASE);
+}
+
+/* Must be called with the writer lock held */
+static struct callsite_slots *callsite_set_grow(struct callsite_slots *old)
+{
+	size_t size = old ? old->size * 2 : CALLSITE_SET_MIN_SIZE, i;
+	struct callsite_slots *t;
+
+	t = meta_alloc(sizeof(*t) + size * sizeof(t->slots[0]));
+	if (!t) {
+		perror(SNAME);
+		pthread_mutex_unlock(&callsite_writer.lock);
+		exit_error();
+	}
+
+	t->size = size;
+	t->prev = old;
+	for (i = 0; old && i < old->size; i++)
+		if (old->slots[i].key)
+			callsite_slots_add(t, old->slots[i].entry);
+
+	__atomic_store_n(&callsite_set.cur, t, __ATOMIC_RELEASE);
+	return t;
+}
+
+/*
+ * Insert a call-site, returns false if it is already in the table. Must
+ * be called with force_libc set.
+ */
+static bool callsite_insert(struct hash_entry *n)
+{
+	struct callsite_slots *t;
+	bool collision;
+
+	pthread_mutex_lock(&callsite_writer.lock);
+
+	t = callsite_set.cur;
+	if (__callsite_find(t, n, &collision)) {
+		pthread_mutex_unlock(&callsite_writer.lock);
+		return false;
+	}
+
+	if (!t || (callsite_writer.nr + 1) * 4 > t->size * 3)
+		t = callsite_set_grow(t);
+
+	callsite_slots_add(t, n);
+	callsite_writer.nr++;
+
+	if (collision)
+		callsite_collisions++;
+	pthread_mutex_unlock(&callsite_writer.lock);
+
+	return true;
+}
+
+static FILE *load_database(void)
+{
+	const char *fname = getenv(PFX "DATABASE");
+	struct hash_entry *h;
+	FILE *dbf;
+	bool ret;
+
+	if (!fname)
+		fname = "failinj.db";
+
+	dbf = fopen(fname, "a+b");
+	if (!dbf) {
+		fprintf(stderr, TAG "Unable to open '%s': %m\n", fname);
+		exit_error();
+	}
+
+	read_db_header(dbf);
+
+	h = create_hash_entry();
+
+	while (read_callsite(dbf, h)) {
+		ret = callsite_insert(h);
+		if (ret) {
+			h = create_hash_entry();
+			continue;
+		}
+
+		meta_free(h->keys);
+		h->keys = NULL;
+
+		/*
+		 * break if we see multiple zero hashes, this is for testing
+		 * with /dev/full which outputs a stream of zeros
+		 */
+		if (h->hash == 0)
+			break;
+	}
+
+	meta_free(h->keys);
+	meta_free(h);
+	return dbf;
+}
+
+/*
+ * Resolve the name of the function containing the return address ip
+ * using a libunwind cursor pointed at it. Like libunwind does for
+ * stepped frames, the lookup is done on the preceding instruction so a
+ * call at the very end of a function still resolves to that function.
+ * This is slow as libunwind maps and walks the module's symbol tables
+ * on every call, so it is only used for addresses sym_lookup() cannot
+ * resolve itself.
+ */
+static int resolve_ip(unw_word_t ip, char *name, size_t len, unw_word_t *off)
+{
+	struct scratch *sc = get_scratch();
+	int ret;
+
+	unw_getcontext(&sc->uc);
+	unw_init_local(&sc->cursor, &sc->uc);
+
+	if (!ip || unw_set_reg(&sc->cursor, UNW_REG_IP, ip - 1))
+		return -1;
+
+	ret = unw_get_proc_name(&sc->cursor, name, len, off);
+	if (ret)
+		return ret;
+
+	*off += 1;
+	return 0;
+}
+
+/*
+ * Sorted set of address ranges, used to check whether an instruction
+ * pointer lies within one of a set of functions with a binary search.
+ */
+struct range {
+	unw_word_t start;
+	unw_word_t end;
+};
+
+struct range_set {
+	struct range *ranges;
+	int nr;
+	int alloc;
+};
+
+static void range_set_add(struct range_set *set, unw_word_t start,
+			  unw_word_t end)
+{
+	struct range *r;
+
+	if (set->nr == set->alloc) {
+		set->alloc = set->alloc ? set->alloc * 2 : 16;
+		r = meta_realloc(set->ranges, set->alloc * sizeof(*r));
+		if (!r) {
+			perror(SNAME);
+			exit_error();
+		}
+		set->ranges = r;
+	}
+
+	r = &set->ranges[set->nr++];
+	r->start = start;
+	r->end = end;
+}
+
+static int cmp_range(const void *a, const void *b)
+{
+	const struct range *ra = a, *rb = b;
+
+	if (ra->start < rb->start)
+		return -1;
+	return ra->start > rb->start;
+}
+
+static void range_set_sort(struct range_set *set)
+{
+	qsort(set->ranges, set->nr, sizeof(*set->ranges), cmp_range);
+}
+
+static bool range_set_contains(const struct range_set *set, unw_word_t addr)
+{
+	int lo = 0, hi = set->nr, mid;
+
+	/* Find the last range starting at or before addr */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (set->ranges[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo && addr < set->ranges[lo - 1].end;
+}
+
+/*
+ * Sorted list of function names parsed from space separated
+ * environment variables.
+ */
+struct name_list {
+	char **names;
+	int nr;
+	int alloc;
+};
+
+static int cmp_name(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void name_list_parse(struct name_list *list, const char *str)
+{
+	char *buf, *tok, *save;
+
+	buf = meta_alloc(strlen(str) + 1);
+	if (!buf) {
+		perror(SNAME);
+		exit_error();
+	}
+	strcpy(buf, str);
+
+	for (tok = strtok_r(buf, " ", &save); tok;
+	     tok = strtok_r(NULL, " ", &save)) {
+		if (list->nr == list->alloc) {
+			list->alloc = list->alloc ? list->alloc * 2 : 16;
+			list->names = meta_realloc(list->names, list->alloc *
+						   sizeof(*list->names));
+			if (!list->names) {
+				perror(SNAME);
+				exit_error();
+			}
+		}
+		list->names[list->nr++] = tok;
+	}
+
+	qsort(list->names, list->nr, sizeof(*list->names), cmp_name);
+}
+
+static unsigned long long name_list_hash(const struct name_list *list)
+{
+	unsigned long long hash = HASH_INIT;
+	int i;
+
+	for (i = 0; i < list->nr; i++)
+		hash = djb_hash_mem(list->names[i], strlen(list->names[i]) + 1,
+				    hash);
+
+	return hash;
+}
+
+static bool name_list_contains(const struct name_list *list, const char *name)
+{
+	return list->nr && bsearch(&name, list->names, list->nr,
+				   sizeof(*list->names), cmp_name);
+}
+
+/*
+ * Map of the loaded modules used to turn raw instruction pointers into
+ * something that is stable across runs and unaffected by ASLR. Each
+ * module is identified by a hash of its GNU build-id (or of its path if
+ * it has none). The map is rebuilt lazily after a dlopen() or dlclose().
+ *
+ * Each module also keeps its ELF file (or its symbol cache file) mapped
+ * along with the functions from its symbol tables sorted by address,
+ * which lets sym_lookup() name a return address with a binary search.
+ * Its path is copied as the loader frees its own on dlclose(). The line
+ * table is only read the first time it is needed.
+ */
+#define MAX_MODULES 512
+
+struct module {
+	unw_word_t start;
+	unw_word_t end;
+	unw_word_t base;
+	unsigned long long id;
+	const char *path;
+	bool has_build_id;
+	bool excluded;
+	struct symbol *syms;
+	int nr_syms;
+	int alloc_syms;
+	const char *names;
+	char *map;
+	size_t map_size;
+	struct line_table lines;
+	bool lines_loaded;
+};
+
+static bool modules_stale = true;
+
+/*
+ * Calls made from a module whose path contains one of the strings in
+ * FAILINJ_EXCLUDE_CALLERS are never failed. Checking the return address
+ * against the module map is much cheaper than unwinding the stack, so
+ * this keeps calls from within libc or the loader (eg. strdup() or
+ * reallocarray() calling malloc()) off the slow path entirely.
+ */
+static struct name_list exclude_callers;
+static int has_exclude_callers = -1;
+
+static bool env_exclude_callers(void)
+{
+	const char *env;
+
+	if (has_exclude_callers < 0) {
+		env = getenv(PFX "EXCLUDE_CALLERS");
+		if (env)
+			name_list_parse(&exclude_callers, env);
+		has_exclude_callers = exclude_callers.nr > 0;
+
+		/* the map may have been built before the list was parsed */
+		__atomic_store_n(&modules_stale, true, __ATOMIC_RELEASE);
+	}
+
+	return has_exclude_callers;
+}
+
+static bool is_excluded_path(const char *path)
+{
+	int i;
+
+	if (!path[0])
+		return false;
+
+	for (i = 0; i < exclude_callers.nr; i++)
+		if (strstr(path, exclude_callers.names[i]))
+			return true;
+
+	return false;
+}
+
+/*
+ * Lists of function names that are resolved to address ranges whenever
+ * the module map changes, so checking whether a frame lies within one
+ * of the functions is a binary search instead of a string comparison:
+ *
+ *  - Unwinding stops at an anchor frame (by default main() or the entry
+ *    of a thread) as nothing below those helps tell call-sites apart.
+ *
+ *  - Calls with a frame in FAILINJ_SKIP_INJECTION, or in exit(), on the
+ *    stack are never failed.
+ *
+ *  - failinj_shadow_context() is found this way, rather than with
+ *    dlsym(), so programs need not export it.
+ */
+struct symbol_filter {
+	const char *env;
+	const char *def;
+	const char *always;
+	bool parsed;
+	unsigned long long key;
+	struct name_list names;
+};
+
+enum {
+	FILTER_ANCHOR,
+	FILTER_SKIP,
+	FILTER_SHADOW,
+	NR_FILTERS,
+};
+
+static struct symbol_filter filters[NR_FILTERS] = {
+	[FILTER_ANCHOR] = {
+		.env = PFX "ANCHORS",
+		.def = "main start_thread",
+		.always = "failinj_fiber_entry",
+	},
+	[FILTER_SKIP] = {
+		.env = PFX "SKIP_INJECTION",
+		.always = "exit",
+	},
+	[FILTER_SHADOW] = {
+		.always = "failinj_shadow_context",
+	},
+};
+
+/*
+ * The map is built into a snapshot that is never changed once it is
+ * published, other than to load line tables, so the lookups made for
+ * every frame take no lock. Only rebuilding it, after the set of loaded
+ * objects changed, is serialized by module_mutex. A snapshot that has
+ * been replaced is retired and only freed once no thread is reading it
+ * anymore, see map_enter().
+ */
+struct module_map {
+	struct module_map *next;
+	unsigned int gen;
+	int nr;
+	/* the library's own frames at the top of the stack are dropped */
+	unw_word_t self_start;
+	unw_word_t self_end;
+	struct range_set ranges[NR_FILTERS];
+	struct module modules[MAX_MODULES];
+};
+
+static pthread_mutex_t module_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct module_map *module_map;
+static struct module_map *retired_maps;
+static unsigned int modules_gen;
+
+static const char *copy_path(const char *path)
+{
+	char *p;
+
+	p = meta_alloc(strlen(path) + 1);
+	if (!p) {
+		perror(SNAME);
+		exit_error();
+	}
+
+	return strcpy(p, path);
+}
+
+static int add_module(struct dl_phdr_info *info, size_t size, void *data)
+{
+	struct module_map *map = data;
+	struct module *m = &map->modules[map->nr];
+	const ElfW(Phdr) *ph;
+	bool has_id = false;
+	unw_word_t start;
+	int i;
+
+	if (map->nr == MAX_MODULES)
+		return 1;
+
+	m->start = ULONG_MAX;
+	m->end = 0;
+	m->base = info->dlpi_addr;
+	m->excluded = is_excluded_path(info->dlpi_name);
+
+	for (i = 0; i < info->dlpi_phnum; i++) {
+		ph = &info->dlpi_phdr[i];
+		start = info->dlpi_addr + ph->p_vaddr;
+
+		if (ph->p_type == PT_LOAD) {
+			if (start < m->start)
+				m->start = start;
+			if (start + ph->p_memsz > m->end)
+				m->end = start + ph->p_memsz;
+		} else if (ph->p_type == PT_NOTE && !has_id) {
+			has_id = elf_note_build_id((const char *)start,
+						   ph->p_memsz,
+						   ph->p_align == 8 ? 8 : 4,
+						   &m->id);
+		}
+	}
+
+	m->has_build_id = has_id;
+	if (!has_id)
+		m->id = djb_hash(info->dlpi_name, HASH_INIT);
+
+	if (m->start < m->end) {
+		m->path = copy_path(info->dlpi_name);
+		map->nr++;
+	}
+
+	return 0;
+}
+
+static int cmp_module(const void *a, const void *b)
+{
+	const struct module *ma = a, *mb = b;
+
+	if (ma->start < mb->start)
+		return -1;
+	return ma->start > mb->start;
+}
+
+static void module_add_symbol(struct module *m, uint64_t off, uint32_t name)
+{
+	struct symbol *sym;
+
+	if (m->nr_syms == m->alloc_syms) {
+		m->alloc_syms = m->alloc_syms ? m->alloc_syms * 2 : 256;
+		sym = meta_realloc(m->syms, m->alloc_syms * sizeof(*sym));
+		if (!sym) {
+			perror(SNAME);
+			exit_error();
+		}
+		m->syms = sym;
+	}
+
+	sym = &m->syms[m->nr_syms];
+	sym->off = off;
+	sym->name = name;
+	sym->seq = m->nr_syms++;
+}
+
+static void module_release(struct module *m)
+{
+	/* symbols loaded from the symbol cache point into its mapping */
+	if (m->alloc_syms)
+		meta_free(m->syms);
+
+	if (m->map)
+		munmap(m->map, m->map_size);
+
+	meta_free(m->lines.rows);
+	meta_free((void *)m->path);
+}
+
+/*
+ * Optional on-disk cache of what module_resolve() finds so later runs
+ * need not read the symbol tables of every module again. Each module
+ * with a build-id gets a file named after it in the FAILINJ_SYMBOL_CACHE
+ * directory. The file holds the module's sorted functions, followed by
+ * the ranges each symbol filter resolved to and then the names. The
+ * ranges are only reused if the filter's list of names is unchanged. A
+ * module rebuilt with a new build-id simply gets a new file.
+ *
+ * The file is mapped read-only and used in place. Addresses in it are
+ * relative to the module's base so it is unaffected by ASLR.
+ */
+#define SYMCACHE_MAGIC "FAILSYM\1"
+
+struct symcache_header {
+	char magic[8];
+	uint64_t id;
+	uint64_t filter_keys[NR_FILTERS];
+	uint32_t nr_ranges[NR_FILTERS];
+	uint32_t nr_syms;
+	uint64_t names_size;
+};
+
+static const char *symcache_dir;
+
+static void symcache_path(const struct module *m, char *path, size_t len)
+{
+	snprintf(path, len, "%s/%016llx.sym", symcache_dir, m->id);
+}
+
+static bool symcache_load(struct module_map *mm, struct module *m)
+{
+	const struct symcache_header *hdr;
+	const struct symbol *syms;
+	struct scratch *sc = get_scratch();
+	char *path = sc->path;
+	const struct range *r;
+	const char *names;
+	struct stat st;
+	size_t size;
+	char *map;
+	int fd, f;
+	uint32_t i;
+
+	symcache_path(m, path, sizeof(sc->path));
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return false;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	hdr = (const void *)map;
+	size = sizeof(*hdr) + (size_t)hdr->nr_syms * sizeof(*syms);
+	for (f = 0; f < NR_FILTERS; f++)
+		size += (size_t)hdr->nr_ranges[f] * sizeof(*r);
+
+	/* the sizes come from the file, so don't let them wrap around */
+	if (memcmp(hdr->magic, SYMCACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->id != m->id || size > st.st_size ||
+	    hdr->names_size != st.st_size - size)
+		goto fail;
+
+	for (f = 0; f < NR_FILTERS; f++)
+		if (hdr->filter_keys[f] != filters[f].key)
+			goto fail;
+
+	syms = (const void *)(hdr + 1);
+	r = (const void *)(syms + hdr->nr_syms);
+	names = map + size;
+
+	if (hdr->names_size && names[hdr->names_size - 1])
+		goto fail;
+
+	for (i = 0; i < hdr->nr_syms; i++)
+		if (syms[i].name >= hdr->names_size)
+			goto fail;
+
+	for (f = 0; f < NR_FILTERS; f++)
+		for (i = 0; i < hdr->nr_ranges[f]; i++, r++)
+			range_set_add(&mm->ranges[f], m->base + r->start,
+				      m->base + r->end);
+
+	m->syms = (struct symbol *)syms;
+	m->nr_syms = hdr->nr_syms;
+	m->names = names;
+	m->map = map;
+	m->map_size = st.st_size;
+	return true;
+
+fail:
+	munmap(map, st.st_size);
+	return false;
+}
+
+/*
+ * Write the module's symbols and the filter ranges added since first
+ * to the cache. It goes to a temporary file first so concurrent runs
+ * never see a partial file.
+ */
+static void symcache_store(const struct module_map *mm,
+			   const struct module *m, const int *first)
+{
+	struct scratch *sc = get_scratch();
+	char *path = sc->path, *tmp = sc->tmp;
+	struct symcache_header hdr = {};
+	const struct range *r;
+	struct symbol sym;
+	struct range rel;
+	const char *name;
+	bool ok = true;
+	FILE *out;
+	int fd, f, i;
+
+	symcache_path(m, path, sizeof(sc->path));
+	snprintf(tmp, sizeof(sc->tmp), "%s.XXXXXX", path);
+
+	mkdir(symcache_dir, 0777);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		return;
+
+	out = fdopen(fd, "w");
+	if (!out) {
+		close(fd);
+		remove(tmp);
+		return;
+	}
+
+	memcpy(hdr.magic, SYMCACHE_MAGIC, sizeof(hdr.magic));
+	hdr.id = m->id;
+	hdr.nr_syms = m->nr_syms;
+	for (f = 0; f < NR_FILTERS; f++) {
+		hdr.filter_keys[f] = filters[f].key;
+		hdr.nr_ranges[f] = mm->ranges[f].nr - first[f];
+	}
+	for (i = 0; i < m->nr_syms; i++)
+		hdr.names_size += strlen(m->names + m->syms[i].name) + 1;
+
+	ok &= fwrite(&hdr, sizeof(hdr), 1, out) == 1;
+
+	for (i = 0, sym.name = 0; i < m->nr_syms; i++) {
+		sym.off = m->syms[i].off;
+		sym.seq = m->syms[i].seq;
+		ok &= fwrite(&sym, sizeof(sym), 1, out) == 1;
+		sym.name += strlen(m->names + m->syms[i].name) + 1;
+	}
+
+	for (f = 0; f < NR_FILTERS; f++) {
+		r = &mm->ranges[f].ranges[first[f]];
+		for (i = 0; i < hdr.nr_ranges[f]; i++, r++) {
+			rel.start = r->start - m->base;
+			rel.end = r->end - m->base;
+			ok &= fwrite(&rel, sizeof(rel), 1, out) == 1;
+		}
+	}
+
+	for (i = 0; i < m->nr_syms; i++) {
+		name = m->names + m->syms[i].name;
+		ok &= fwrite(name, strlen(name) + 1, 1, out) == 1;
+	}
+
+	ok &= fclose(out) == 0;
+	if (!ok || rename(tmp, path))
+		remove(tmp);
+}
+
+/*
+ * Add the address range of every function in the module's ELF symbol
+ * tables to the filters that list its name, and collect the functions
+ * for sym_lookup(). This reads the file backing the module so it also
+ * finds static functions which dladdr() cannot. The file stays mapped
+ * as the collected names point into its string tables.
+ */
+struct resolve_ctx {
+	struct module_map *map;
+	struct module *m;
+};
+
+static void module_add_function(void *data, const ElfW(Sym) *sym,
+				uint64_t name)
+{
+	struct resolve_ctx *ctx = data;
+	struct module *m = ctx->m;
+	unw_word_t start = m->base + sym->st_value;
+	int f;
+
+	if (name <= UINT32_MAX)
+		module_add_symbol(m, sym->st_value, name);
+
+	for (f = 0; f < NR_FILTERS; f++)
+		if (name_list_contains(&filters[f].names, m->names + name))
+			range_set_add(&ctx->map->ranges[f], start,
+				      start + (sym->st_size ?: 1));
+}
+
+static void module_resolve(struct module_map *map, struct module *m)
+{
+	const char *path = m->path[0] ? m->path : "/proc/self/exe";
+	struct resolve_ctx ctx = { .map = map, .m = m };
+	bool use_cache = symcache_dir && m->has_build_id;
+	int first[NR_FILTERS];
+	struct elf_image e;
+	int f;
+
+	if (use_cache && symcache_load(map, m))
+		return;
+
+	for (f = 0; f < NR_FILTERS; f++)
+		first[f] = map->ranges[f].nr;
+
+	if (!elf_open(&e, path))
+		return;
+
+	m->names = e.map;
+	elf_for_each_function(&e, module_add_function, &ctx);
+	m->nr_syms = symbols_sort(m->syms, m->nr_syms);
+
+	if (use_cache)
+		symcache_store(map, m, first);
+
+	if (m->nr_syms) {
+		m->map = e.map;
+		m->map_size = e.size;
+		return;
+	}
+
+	m->names = NULL;
+	elf_close(&e);
+}
+
+static void resolve_filters(struct module_map *map)
+{
+	struct symbol_filter *filt;
+	struct module *m;
+	const char *env;
+	int i;
+
+	for (i = 0; i < NR_FILTERS; i++) {
+		filt = &filters[i];
+		if (!filt->parsed) {
+			env = filt->env ? getenv(filt->env) : NULL;
+			if (env || filt->def)
+				name_list_parse(&filt->names, env ?: filt->def);
+			if (filt->always)
+				name_list_parse(&filt->names, filt->always);
+			filt->key = name_list_hash(&filt->names);
+			filt->parsed = true;
+		}
+	}
+
+	symcache_dir = getenv(PFX "SYMBOL_CACHE");
+
+	for (i = 0; i < map->nr; i++) {
+		m = &map->modules[i];
+		module_resolve(map, m);
+
+		if ((unw_word_t)resolve_filters >= m->start &&
+		    (unw_word_t)resolve_filters < m->end) {
+			map->self_start = m->start;
+			map->self_end = m->end;
+		}
+	}
+
+	for (i = 0; i < NR_FILTERS; i++)
+		range_set_sort(&map->ranges[i]);
+}
+
+static void module_map_free(struct module_map *map)
+{
+	int i;
+
+	for (i = 0; i < map->nr; i++)
+		module_release(&map->modules[i]);
+
+	for (i = 0; i < NR_FILTERS; i++)
+		meta_free(map->ranges[i].ranges);
+
+	meta_free(map);
+}
+
+static bool module_map_in_use(const struct module_map *map)
+{
+	struct scratch *sc;
+
+	for (sc = scratch_list; sc; sc = sc->next)
+		if (__atomic_load_n(&sc->map, __ATOMIC_SEQ_CST) == map)
+			return true;
+
+	return false;
+}
+
+/* Must be called with module_mutex held */
+static void free_retired_maps(void)
+{
+	struct module_map **p = &retired_maps, *map;
+
+	pthread_mutex_lock(&scratch_mutex);
+	while ((map = *p)) {
+		if (module_map_in_use(map)) {
+			p = &map->next;
+			continue;
+		}
+
+		*p = map->next;
+		module_map_free(map);
+	}
+	pthread_mutex_unlock(&scratch_mutex);
+}
+
+/*
+ * Build a new snapshot of the map, unless another thread already did,
+ * and publish it. Must be called with force_libc set.
+ */
+static void update_modules(void)
+{
+	struct module_map *map, *old;
+
+	pthread_mutex_lock(&module_mutex);
+	if (!__atomic_load_n(&modules_stale, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_unlock(&module_mutex);
+		return;
+	}
+
+	/* an object loaded from now on marks the new map stale again */
+	__atomic_store_n(&modules_stale, false, __ATOMIC_SEQ_CST);
+
+	map = meta_alloc(sizeof(*map));
+	if (!map) {
+		perror(SNAME);
+		pthread_mutex_unlock(&module_mutex);
+		exit_error();
+	}
+
+	dl_iterate_phdr(add_module, map);
+	qsort(map->modules, map->nr, sizeof(*map->modules), cmp_module);
+	map->gen = ++modules_gen;
+	resolve_filters(map);
+
+	old = module_map;
+	__atomic_store_n(&module_map, map, __ATOMIC_SEQ_CST);
+	if (old) {
+		old->next = retired_maps;
+		retired_maps = old;
+	}
+
+	free_retired_maps();
+	pthread_mutex_unlock(&module_mutex);
+}
+
+/*
+ * Get the current snapshot of the map, which stays valid until the
+ * matching map_exit(). The snapshot is announced in the thread's
+ * scratch buffers before it is used, and checked to still be current
+ * after, so update_modules() either sees it is in use or has already
+ * replaced it before this thread could have picked it up. Nested calls
+ * get the snapshot of the outermost one. Must be called with force_libc
+ * set.
+ */
+static struct module_map *map_enter(void)
+{
+	struct scratch *sc = get_scratch();
+	struct module_map *map;
+
+	if (sc->map_depth++)
+		return sc->map;
+
+	if (__atomic_load_n(&modules_stale, __ATOMIC_ACQUIRE))
+		update_modules();
+
+	do {
+		map = __atomic_load_n(&module_map, __ATOMIC_ACQUIRE);
+		__atomic_store_n(&sc->map, map, __ATOMIC_SEQ_CST);
+	} while (map != __atomic_load_n(&module_map, __ATOMIC_SEQ_CST));
+
+	return map;
+}
+
+static void map_exit(void)
+{
+	struct scratch *sc = scratch;
+
+	if (!--sc->map_depth)
+		__atomic_store_n(&sc->map, NULL, __ATOMIC_RELEASE);
+}
+
+/*
+ * Frames are checked by the address of the call instruction, not the
+ * return address, which may already be past the end of the function.
+ */
+static bool is_own_frame(const struct module_map *map, unw_word_t ip)
+{
+	return ip - 1 >= map->self_start && ip - 1 < map->self_end;
+}
+
+static bool is_anchor_frame(const struct module_map *map, unw_word_t ip)
+{
+	return range_set_contains(&map->ranges[FILTER_ANCHOR], ip - 1);
+}
+
+static bool is_skipped_frame(const struct module_map *map, unw_word_t ip)
+{
+	return range_set_contains(&map->ranges[FILTER_SKIP], ip - 1);
+}
+
+static void find_shadow_stack(void)
+{
+	struct module_map *map = map_enter();
+	struct range_set *set = &map->ranges[FILTER_SHADOW];
+
+	if (set->nr)
+		shadow_context = (void *)set->ranges[0].start;
+	map_exit();
+}
+
+static struct module *module_find(struct module_map *map, unw_word_t ip)
+{
+	int lo = 0, hi = map->nr, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ip < map->modules[mid].start)
+			hi = mid;
+		else if (ip >= map->modules[mid].end)
+			lo = mid + 1;
+		else
+			return &map->modules[mid];
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the name of the function containing the return address ip and
+ * the offset of ip into it, like unw_get_proc_name(). The lookup does
+ * not allocate, so it is safe from within the intercepted functions.
+ * Returns zero on success or -1 if the name could not be resolved.
+ */
+static int sym_lookup(unw_word_t ip, char *name, size_t len, unw_word_t *off)
+{
+	struct module_map *map = map_enter();
+	const struct symbol *sym = NULL;
+	struct module *m;
+
+	m = module_find(map, ip - 1);
+	if (m) {
+		sym = symbols_find(m->syms, m->nr_syms, ip - 1 - m->base);
+		if (sym) {
+			snprintf(name, len, "%s", m->names + sym->name);
+			*off = ip - (m->base + sym->off);
+		}
+	}
+	map_exit();
+
+	if (!sym)
+		return resolve_ip(ip, name, len, off) ? -1 : 0;
+
+	return 0;
+}
+
+static void *line_realloc(void *p, size_t size)
+{
+	p = meta_realloc(p, size);
+	if (!p) {
+		perror(SNAME);
+		exit_error();
+	}
+
+	return p;
+}
+
+/*
+ * Read the line number table from the .debug_line section of the file
+ * backing the module. The table stays empty if the file has none, is
+ * compressed, or its debug info is in a separate file. Threads may race
+ * to load it, so it is read under module_mutex and only marked loaded
+ * once complete.
+ */
+static void module_load_lines(struct module *m)
+{
+	const char *path = m->path[0] ? m->path : "/proc/self/exe";
+	const ElfW(Shdr) *sh;
+	struct elf_image e;
+
+	pthread_mutex_lock(&module_mutex);
+	if (m->lines_loaded)
+		goto out;
+
+	if (elf_open(&e, path)) {
+		sh = elf_section(&e, ".debug_line");
+		if (sh)
+			line_table_parse(&m->lines, e.map + sh->sh_offset,
+					 sh->sh_size, line_realloc);
+
+		elf_close(&e);
+	}
+
+	__atomic_store_n(&m->lines_loaded, true, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&module_mutex);
+}
+
+/*
+ * Find the word identifying the call at return address ip, off bytes into
+ * its function, by its position in the source. See line_table_word().
+ * Returns zero if there is no line info for it.
+ */
+static unsigned long long sym_line(unw_word_t ip, unw_word_t off)
+{
+	struct module_map *map = map_enter();
+	unsigned long long word = 0;
+	struct module *m;
+
+	m = module_find(map, ip - 1);
+	if (m) {
+		if (!__atomic_load_n(&m->lines_loaded, __ATOMIC_ACQUIRE))
+			module_load_lines(m);
+
+		word = line_table_word(&m->lines, ip - off - m->base,
+				       ip - 1 - m->base);
+	}
+	map_exit();
+
+	return word;
+}
+
+static bool is_excluded_caller(void *caller)
+{
+	struct module_map *map;
+	struct module *m;
+	bool ret;
+
+	if (!env_exclude_callers())
+		return false;
+
+	map = map_enter();
+	m = module_find(map, (unw_word_t)caller - 1);
+	ret = m && m->excluded;
+	map_exit();
+
+	return ret;
+}
+
+/*
+ * Called after the set of loaded objects has changed. libunwind only
+ * needs to drop what it cached about code that may have been unmapped
+ * (a later dlopen() could map something else at the same address), the
+ * library's own caches need rebuilding after either.
+ */
+static void flush_caches(bool unloaded)
+{
+	if (unloaded)
+		unw_flush_cache(unw_local_addr_space, 0, 0);
+
+	__atomic_store_n(&modules_stale, true, __ATOMIC_RELEASE);
+}
+
+enum unwinder {
+	UNWINDER_LIBUNWIND,
+	UNWINDER_FP,
+};
+
+static enum unwinder get_unwinder(void)
+{
+	static int unwinder = -1;
+	const char *env;
+
+	if (unwinder >= 0)
+		return unwinder;
+
+	env = getenv(PFX "UNWINDER");
+	if (env && !strcmp(env, "fp"))
+		unwinder = UNWINDER_FP;
+	else
+		unwinder = UNWINDER_LIBUNWIND;
+
+	return unwinder;
+}
+
+static __thread __attribute__((tls_model("initial-exec")))
+	unw_word_t stack_lo, stack_hi;
+
+static bool get_stack_bounds(void)
+{
+	pthread_attr_t attr;
+	size_t size;
+	void *addr;
+	int ret;
+
+	if (stack_hi)
+		return true;
+
+	if (pthread_getattr_np(pthread_self(), &attr))
+		return false;
+
+	ret = pthread_attr_getstack(&attr, &addr, &size);
+	pthread_attr_destroy(&attr);
+	if (ret)
+		return false;
+
+	stack_lo = (unw_word_t)addr;
+	stack_hi = stack_lo + size;
+	return true;
+}
+
+/*
+ * Walk the chain of frame pointers starting at the frame fp, storing
+ * the return address of each frame in ips, dropping the library's own
+ * frames and stopping at an anchor frame. This is much cheaper than
+ * interpreting the DWARF unwind information but only works if the
+ * program (and this library) was built with -fno-omit-frame-pointer.
+ * Functions built without frame pointers are free to use the register
+ * for anything: if they leave it alone their frames are missed, if not
+ * the walk follows whatever it holds and may record bogus frames until
+ * one of the checks below notices. The walk ends when the chain leaves
+ * the thread's stack.
+ *
+ * Returns the number of frames found, or -1 if the chain looks broken
+ * (a return address outside any loaded module or a frame pointer that
+ * doesn't move up the stack) and libunwind should be used instead.
+ */
+static int fp_backtrace(void *fp, unw_word_t *ips, int max)
+{
+	unw_word_t *frame = fp, *next;
+	struct module_map *map;
+	int nr = 0;
+
+	if (!get_stack_bounds())
+		return -1;
+
+	if ((unw_word_t)frame < stack_lo || (unw_word_t)frame >= stack_hi)
+		return -1;
+
+	map = map_enter();
+
+	while (nr < max) {
+		if (!frame[1])
+			break;
+
+		if (!module_find(map, frame[1])) {
+			nr = -1;
+			break;
+		}
+
+		if (nr || !is_own_frame(map, frame[1])) {
+			ips[nr++] = frame[1];
+			if (is_anchor_frame(map, frame[1]))
+				break;
+		}
+
+		next = (unw_word_t *)frame[0];
+		if ((unw_word_t)next < stack_lo ||
+		    (unw_word_t)(next + 2) > stack_hi)
+			break;
+
+		if (next <= frame || (unw_word_t)next % sizeof(*next)) {
+			nr = -1;
+			break;
+		}
+
+		frame = next;
+	}
+
+	map_exit();
+
+	return nr;
+}
+
+/*
+ * By default libunwind keeps one cache of the unwind information it has
+ * parsed, shared by all threads and taken under a lock with signals
+ * blocked for every frame. A per-thread cache avoids both. This is done
+ * on the first unwind rather than in a constructor as libunwind may call
+ * back into intercepted functions while switching.
+ */
+static pthread_once_t unwinder_once = PTHREAD_ONCE_INIT;
+
+static void init_unwinder(void)
+{
+	unw_set_caching_policy(unw_local_addr_space, UNW_CACHE_PER_THREAD);
+}
+
+/*
+ * Capture the return addresses of the current stack into ips in one go
+ * using the selected unwinder. The first address is the return address
+ * into the code that called into the library and the last is in the
+ * outermost anchor frame, or the max'th frame. The libunwind backend
+ * uses unw_backtrace() which has a cached fast path that avoids
+ * stepping a cursor through the DWARF information frame by frame; its
+ * result is trimmed afterwards.
+ *
+ * Returns the number of addresses captured (at most max).
+ */
+__attribute__((noinline))
+static int capture_stack(unw_word_t *ips, int max)
+{
+	void **buf = get_scratch()->buf;
+	struct module_map *map;
+	bool anchored = false;
+	int i, n, size, nr = 0;
+
+	if (get_unwinder() == UNWINDER_FP) {
+		nr = fp_backtrace(__builtin_frame_address(0), ips, max);
+		if (nr >= 0)
+			return nr;
+	}
+
+	/*
+	 * How many of the library's own frames are on top is only known
+	 * after unwinding, so leave some room for them and unwind the
+	 * whole stack if that turns out not to be enough.
+	 */
+	size = MAX_FRAMES;
+	if (max < MAX_FRAMES - OWN_FRAMES_SLACK)
+		size = max + OWN_FRAMES_SLACK;
+
+	pthread_once(&unwinder_once, init_unwinder);
+
+retry:
+	n = unw_backtrace(buf, size);
+
+	map = map_enter();
+
+	for (i = 0; i < n && is_own_frame(map, (unw_word_t)buf[i]); i++)
+		;
+
+	for (nr = 0; i < n && nr < max && !anchored; i++) {
+		ips[nr++] = (unw_word_t)buf[i];
+		anchored = is_anchor_frame(map, ips[nr - 1]);
+	}
+	map_exit();
+
+	if (nr < max && !anchored && n == size && size < MAX_FRAMES) {
+		size = MAX_FRAMES;
+		goto retry;
+	}
+
+	return nr;
+}
+
+/*
+ * The stack of an intercepted call. It lives in the frame of the
+ * interposed function and is captured the first time anything needs it,
+ * so hashing, printing and tracking of one call share a single unwind.
+ * The return addresses themselves are kept in the thread's scratch
+ * buffers.
+ */
+struct stack {
+	int nr;
+	int max;
+	unw_word_t *ips;
+};
+
+static void stack_init(struct stack *s)
+{
+	s->nr = -1;
+	s->max = MAX_FRAMES;
+	s->ips = NULL;
+}
+
+static void stack_capture(struct stack *s)
+{
+	struct scratch *sc = get_scratch();
+
+	if (s->nr >= 0 && sc->owner == s)
+		return;
+
+	sc->owner = s;
+	s->ips = sc->ips;
+	s->nr = capture_stack(s->ips, s->max);
+}
+
+/* Capture the whole stack if only its innermost frames were unwound */
+static void stack_capture_all(struct stack *s)
+{
+	if (s->max < MAX_FRAMES && s->nr == s->max) {
+		s->max = MAX_FRAMES;
+		s->nr = -1;
+	}
+
+	stack_capture(s);
+}
+
+/*
+ * Only the innermost frames above an interposed function can be made to
+ * count towards a call-site's identity, which also means only those
+ * frames get unwound. The depth is set per family of functions, or for
+ * all of them with FAILINJ_CONTEXT_DEPTH; 0 means the whole stack.
+ */
+struct context_family {
+	const char *env;
+	const char *names;
+};
+
+static const struct context_family context_families[] = {
+	{
+		.env = PFX "MEM_CONTEXT_DEPTH",
+		.names = "malloc calloc realloc getline getdelim "
+			 "__getdelim mmap mprotect",
+	}, {
+		.env = PFX "FD_CONTEXT_DEPTH",
+		.names = "creat open openat close read write syscall",
+	}, {
+		.env = PFX "FILE_CONTEXT_DEPTH",
+		.names = "fopen fdopen fmemopen tmpfile fclose fcloseall "
+			 "fwrite fread fflush vsscanf vfscanf "
+			 "__isoc99_vsscanf",
+	},
+};
+
+static bool name_in_list(const char *name, const char *list)
+{
+	size_t len = strlen(name);
+	const char *p = list;
+
+	while ((p = strstr(p, name))) {
+		if ((p == list || p[-1] == ' ') &&
+		    (p[len] == ' ' || !p[len]))
+			return true;
+		p += len;
+	}
+
+	return false;
+}
+
+/* The depth for a family, or for functions in none if fam is NULL */
+static int family_depth(const struct context_family *fam)
+{
+	const char *env = NULL;
+	int depth;
+
+	if (fam)
+		env = getenv(fam->env);
+	if (!env)
+		env = getenv(PFX "CONTEXT_DEPTH");
+	if (!env)
+		return MAX_FRAMES;
+
+	depth = atoi(env);
+	if (depth <= 0 || depth > MAX_FRAMES)
+		return MAX_FRAMES;
+
+	return depth;
+}
+
+static int context_depth(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(context_families); i++)
+		if (name_in_list(name, context_families[i].names))
+			return family_depth(&context_families[i]);
+
+	return family_depth(NULL);
+}
+
+/*
+ * The context settings change which frames make up a call-site, so a
+ * hash of them is recorded in the database. The anchors are parsed by
+ * the time the database is opened as finding the shadow stack resolves
+ * the filters.
+ */
+static unsigned long long context_key(void)
+{
+	uint32_t depths[ARRAY_SIZE(context_families) + 1];
+	unsigned long long key;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(context_families); i++)
+		depths[i] = family_depth(&context_families[i]);
+	depths[i] = family_depth(NULL);
+
+	key = djb_hash_mem(depths, sizeof(depths), HASH_INIT);
+	return djb_hash_mem(&filters[FILTER_ANCHOR].key,
+			    sizeof(filters[FILTER_ANCHOR].key), key);
+}
+
+/* The depth for name looked up once per call-site of the macro */
+#define context_depth_of(name) ({ \
+	static int __depth; \
+	if (!__depth) \
+		__depth = context_depth(#name); \
+	__depth; \
+})
+
+/* Add a frame identified by two words to the hash */
+static void hash_frame_words(struct hash_entry *h, const unsigned long long *w)
+{
+	if (hash_scheme == HASH_MIX128)
+		mix128_words(w, 2, &h->hash, &h->hash_hi);
+	else
+		h->hash = hash_words(w, 2, h->hash);
+}
+
+/*
+ * Hash one frame by the name of its function and the offset into it, or
+ * in line mode the position of the call in the function's source where
+ * the module has line info. If key is not NULL, it is set to the two
+ * words identifying the frame.
+ */
+static void hash_frame_symbol(unw_word_t ip, struct hash_entry *h,
+			      unsigned long long *key)
+{
+	struct scratch *sc = get_scratch();
+	unsigned long long w[2] = {};
+	char *name = sc->name;
+	unw_word_t off;
+	int ret;
+
+	ret = sym_lookup(ip, name, sizeof(sc->name), &off);
+	if (ret == 0) {
+		w[0] = djb_hash(name, HASH_INIT);
+		w[1] = off;
+
+		if (callsite_id == CALLSITE_ID_LINE)
+			w[1] = sym_line(ip, off) ?: off;
+	}
+
+	if (key)
+		memcpy(key, w, sizeof(w));
+
+	if (callsite_id == CALLSITE_ID_LINE && hash_scheme == HASH_DJB) {
+		h->hash = djb_hash_mem(w, sizeof(w), h->hash);
+		return;
+	}
+
+	if (hash_scheme != HASH_DJB) {
+		hash_frame_words(h, w);
+		return;
+	}
+
+	if (ret != 0)
+		strcpy(name, "unknown");
+	else
+		snprintf(name + strlen(name), sizeof(sc->name) - strlen(name),
+			 "+0x%lx", off);
+
+	h->hash = djb_hash(name, h->hash);
+}
+
+/*
+ * Hash a stack by the build-id of each frame's module and the module
+ * relative return address. This needs no symbols so it is cheap and
+ * works on stripped binaries.
+ */
+static void hash_stack_build_id(const unw_word_t *ips, int nr,
+				struct hash_entry *h)
+{
+	struct module_map *map = map_enter();
+	unsigned long long w[2];
+	struct module *m;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		m = module_find(map, ips[i]);
+		w[0] = m ? m->id : 0;
+		w[1] = m ? ips[i] - m->base : 0;
+
+		if (h->keys)
+			memcpy(&h->keys[i * 2], w, sizeof(w));
+
+		if (hash_scheme != HASH_DJB) {
+			hash_frame_words(h, w);
+			continue;
+		}
+
+		h->hash = djb_hash_mem(&w[0], sizeof(w[0]), h->hash);
+		h->hash = djb_hash_mem(&w[1], sizeof(w[1]), h->hash);
+	}
+	map_exit();
+}
+
+/* Check whether any frame is in a function calls should not fail under */
+static bool is_skipped_stack(const unw_word_t *ips, int nr)
+{
+	struct module_map *map = map_enter();
+	bool ret = false;
+	int i;
+
+	for (i = 0; i < nr && !ret; i++)
+		ret = is_skipped_frame(map, ips[i]);
+	map_exit();
+
+	return ret;
+}
+
+/*
+ * Recursion gives a different stack at every depth. Collapse any run of
+ * up to max_cycle frames that repeats back to back into a single copy,
+ * so a recursive function (or set of mutually recursive functions) is
+ * the same call-site however deep it goes. Returns the new depth.
+ */
+static int collapse_stack(const unw_word_t *ips, int nr, unw_word_t *out,
+			  int max_cycle)
+{
+	int i, c, n = 0;
+
+	for (i = 0; i < nr; i++) {
+		out[n++] = ips[i];
+
+		for (c = 1; c <= max_cycle && 2 * c <= n; c++) {
+			if (memcmp(&out[n - c], &out[n - 2 * c],
+				   c * sizeof(*out)))
+				continue;
+
+			/* removing a copy may expose another repeat */
+			n -= c;
+			c = 0;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Hash the innermost depth frames of a stack into h, also filling in
+ * h->keys if it is set. Sets h->nr_frames to the number of frames
+ * hashed after collapsing recursion.
+ */
+static void stack_hash(const struct stack *s, int depth, struct hash_entry *h)
+{
+	int i, nr = s->nr < depth ? s->nr : depth;
+	const unw_word_t *ips = s->ips;
+	unw_word_t *collapsed;
+
+	if (collapse_cycles) {
+		collapsed = get_scratch()->collapsed;
+		nr = collapse_stack(s->ips, nr, collapsed, collapse_cycles);
+		ips = collapsed;
+	}
+
+	h->nr_frames = nr;
+
+	if (callsite_id == CALLSITE_ID_BUILD_ID) {
+		hash_stack_build_id(ips, nr, h);
+		return;
+	}
+
+	for (i = 0; i < nr; i++)
+		hash_frame_symbol(ips[i], h, h->keys ? &h->keys[i * 2] : NULL);
+}
+
+/*
+ * Hash the shadow stack's context along with the module and offset of
+ * the return address into the code that made the intercepted call, as
+ * the context only tells apart the instrumented functions leading up
+ * to it.
+ */
+static void shadow_hash(unw_word_t caller, struct hash_entry *h)
+{
+	struct module_map *map = map_enter();
+	unsigned long long w[2];
+	struct module *m;
+
+	m = module_find(map, caller);
+	w[0] = m ? m->id : 0;
+	w[1] = m ? caller - m->base : 0;
+	map_exit();
+
+	if (hash_scheme == HASH_DJB)
+		h->hash = djb_hash_mem(w, sizeof(w), h->hash);
+	else
+		hash_frame_words(h, w);
+
+	w[0] = shadow_context();
+	w[1] = 0;
+
+	if (hash_scheme == HASH_DJB)
+		h->hash = djb_hash_mem(w, sizeof(w[0]), h->hash);
+	else
+		hash_frame_words(h, w);
+}
+
+/*
+ * The stacks of threads end at start_thread(), so the same code run by
+ * threads of different pools gives the same call-sites. With
+ * FAILINJ_THREAD_ORIGIN, each thread carries a hash of the stack that
+ * called pthread_create() (mixed with its creator's own origin) and
+ * with FAILINJ_THREAD_ROLE, a hash of its name with any trailing
+ * number stripped, so "worker-1" and "worker-2" share a role. Either
+ * is mixed into the identity of every call-site the thread reaches.
+ *
+ * Names are read again only after pthread_setname_np() has been called
+ * by some thread; renaming through prctl() directly is not noticed.
+ *
+ * Fibers started with makecontext() are treated the same way with
+ * FAILINJ_FIBER_ORIGIN, see failinj_fiber_entry().
+ */
+static __thread __attribute__((tls_model("initial-exec")))
+	unsigned long long thread_origin;
+static __thread __attribute__((tls_model("initial-exec")))
+	unsigned long long fiber_origin;
+static __thread __attribute__((tls_model("initial-exec")))
+	unsigned long long thread_role;
+static __thread __attribute__((tls_model("initial-exec")))
+	unsigned int thread_role_gen;
+static unsigned int role_gen = 1;
+
+static unsigned long long get_thread_role(void)
+{
+	unsigned int gen = __atomic_load_n(&role_gen, __ATOMIC_ACQUIRE);
+	char name[16];
+	int len;
+
+	if (thread_role_gen == gen)
+		return thread_role;
+
+	if (pthread_getname_np(pthread_self(), name, sizeof(name)))
+		name[0] = 0;
+
+	len = strlen(name);
+	while (len && strchr("0123456789-_.:# ", name[len - 1]))
+		len--;
+
+	thread_role = djb_hash_mem(name, len, HASH_INIT);
+	thread_role_gen = gen;
+
+	return thread_role;
+}
+
+static void thread_hash(struct hash_entry *h)
+{
+	unsigned long long w = 0;
+
+	if (mix_thread_origin)
+		w ^= thread_origin;
+	if (mix_thread_role)
+		w ^= fmix64(get_thread_role());
+	if (mix_fiber_origin)
+		w ^= fiber_origin;
+
+	h->hash = fmix64(h->hash ^ w);
+	if (hash_scheme == HASH_MIX128)
+		h->hash_hi = fmix64(h->hash_hi ^ w);
+}
+
+/*
+ * Count each distinct stack which only matched a known call-site once
+ * its recursion was collapsed. The raw return addresses are good enough
+ * to tell stacks apart within one run. This runs on every such hit, so
+ * the stacks seen are kept in a fixed size table filled without any
+ * lock. Once a stack finds no free slot among the few it may probe, the
+ * count becomes a lower bound.
+ */
+#define MERGED_SLOTS 4096
+#define MERGED_PROBES 8
+
+static unsigned long long merged_slots[MERGED_SLOTS];
+static bool merged_overflow;
+
+static void count_merged_stack(const struct stack *s)
+{
+	unsigned long long hash, k;
+	size_t slot, i, n;
+
+	hash = djb_hash_mem(s->ips, s->nr * sizeof(s->ips[0]), HASH_INIT) ?: 1;
+	slot = fmix64(hash);
+
+	for (n = 0; n < MERGED_PROBES; n++) {
+		i = (slot + n) & (MERGED_SLOTS - 1);
+		k = __atomic_load_n(&merged_slots[i], __ATOMIC_RELAXED);
+		if (!k && __atomic_compare_exchange_n(&merged_slots[i], &k,
+						      hash, false,
+						      __ATOMIC_RELAXED,
+						      __ATOMIC_RELAXED)) {
+			__atomic_add_fetch(&merged_stacks, 1,
+					   __ATOMIC_RELAXED);
+			return;
+		}
+		if (k == hash)
+			return;
+	}
+
+	__atomic_store_n(&merged_overflow, true, __ATOMIC_RELAXED);
+}
+
+/*
+ * With FAILINJ_RAW_BACKTRACES set to a file, backtraces are not
+ * symbolized in the process at all. They are appended to the file as
+ * raw return addresses, along with the map of loaded modules they refer
+ * to whenever it changes, for failinj-symbolize to resolve afterwards.
+ * Every line starts with the kind of record and the pid, so the file
+ * can be shared by all the runs of a campaign and by forked children.
+ */
+static pthread_mutex_t raw_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *raw_log;
+
+static const char *raw_log_path(void)
+{
+	static const char *path;
+	static bool checked;
+
+	if (!checked) {
+		path = getenv(PFX "RAW_BACKTRACES");
+		checked = true;
+	}
+
+	return path;
+}
+
+/* Must be called with raw_log_mutex held */
+static void raw_log_modules(void)
+{
+	static unsigned int logged_gen;
+	static pid_t logged_pid;
+	struct module_map *map = map_enter();
+	char *exe = get_scratch()->path;
+	const struct module *m;
+	const char *path;
+	pid_t pid = getpid();
+	int i;
+
+	if (pid == logged_pid && map->gen == logged_gen)
+		goto out;
+
+	fprintf(raw_log, "modules %d %d\n", pid, map->nr);
+	for (i = 0; i < map->nr; i++) {
+		m = &map->modules[i];
+		path = m->path;
+		if (!path[0])
+			path = realpath("/proc/self/exe", exe) ?: "";
+
+		fprintf(raw_log, "module %d %016llx %lx %lx %lx %s\n", pid,
+			m->id, m->base, m->start, m->end, path);
+	}
+
+	logged_pid = pid;
+	logged_gen = map->gen;
+
+out:
+	map_exit();
+}
+
+static bool raw_log_trace(const char *msg, const unw_word_t *ips, int nr)
+{
+	const char *path = raw_log_path();
+	int i;
+
+	if (!path)
+		return false;
+
+	pthread_mutex_lock(&raw_log_mutex);
+	if (!raw_log) {
+		raw_log = fopen(path, "a");
+		if (!raw_log) {
+			perror(path);
+			exit_error();
+		}
+	}
+
+	raw_log_modules();
+
+	fprintf(raw_log, "trace %d %d ", getpid(), nr);
+	for (; *msg == '\n'; msg++)
+		;
+	for (; *msg && strcmp(msg, "\n"); msg++)
+		fputc(*msg == '\n' ? ' ' : *msg, raw_log);
+	fputc('\n', raw_log);
+
+	for (i = 0; i < nr; i++)
+		fprintf(raw_log, "%lx\n", ips[i]);
+	fflush(raw_log);
+	pthread_mutex_unlock(&raw_log_mutex);
+
+	return true;
+}
+
+static void print_frames(const unw_word_t *ips, int nr)
+{
+	struct scratch *sc = get_scratch();
+	char *name = sc->name;
+	unw_word_t off;
+	int i, ret;
+
+	for (i = 0; i < nr; i++) {
+		ret = sym_lookup(ips[i], name, sizeof(sc->name), &off);
+		if (ret == 0)
+			fprintf(stderr, "    %s+0x%lx\n", name, off);
+		else
+			fprintf(stderr, "    ?unknown\n");
+	}
+}
+
+/*
+ * Print the message, formatted like printf(), followed by the
+ * backtrace or, in raw mode, a pointer to where it was logged.
+ */
+__attribute__((format(printf, 3, 4)))
+static void print_report(const unw_word_t *ips, int nr, const char *fmt, ...)
+{
+	char msg[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	fputs(msg, stderr);
+	if (raw_log_trace(msg, ips, nr))
+		fprintf(stderr, "    (raw backtrace in %s)\n", raw_log_path());
+	else
+		print_frames(ips, nr);
+}
+
+static void print_injection(const char *name, const struct stack *s)
+{
+	print_report(s->ips, s->nr, TAG "Injecting failure in %s() at:\n",
+		     name);
+	fprintf(stderr, "\n");
+}
+
+/*
+ * The stack may be NULL for calls that track nothing, only the frames
+ * identifying the call-site are unwound for those. Otherwise the whole
+ * stack is, as it is also recorded with the tracked resource. A
+ * call-site that is already in the database is only looked up so the
+ * common path does not allocate.
+ */
+static FILE *dbf;
+static pthread_mutex_t dbf_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Must be called with force_libc set */
+static void open_database(void)
+{
+	if (__atomic_load_n(&dbf, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&dbf_mutex);
+	if (!dbf) {
+		find_shadow_stack();
+		__atomic_store_n(&dbf, load_database(), __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&dbf_mutex);
+}
+
+static bool should_fail(const char *name, int depth, void *caller,
+			struct stack *stack)
+{
+	struct hash_entry key = {}, *h;
+	unsigned long long *keys;
+	int saved_errno = errno;
+	struct stack local;
+	bool ret = false;
+
+	if (!stack) {
+		stack_init(&local);
+		local.max = depth;
+		stack = &local;
+	}
+
+	if (has_injected_failure)
+		return false;
+
+	force_libc = true;
+
+	if (is_excluded_caller(caller))
+		goto out;
+
+	open_database();
+
+	key.hash = HASH_INIT;
+	keys = get_scratch()->keys;
+	if (verify_callsites)
+		key.keys = keys;
+
+	if (callsite_id == CALLSITE_ID_SHADOW) {
+		shadow_hash((unw_word_t)caller, &key);
+	} else {
+		stack_capture(stack);
+		stack_hash(stack, depth, &key);
+	}
+
+	if (mix_thread_origin || mix_thread_role || mix_fiber_origin)
+		thread_hash(&key);
+
+	if (callsite_find(&key)) {
+		if (key.nr_frames < stack->nr && key.nr_frames < depth)
+			count_merged_stack(stack);
+		goto out;
+	}
+
+	/* skipped call-sites are never inserted so only new ones are checked */
+	stack_capture_all(stack);
+	if (is_skipped_stack(stack->ips, stack->nr))
+		goto out;
+
+	/* only one thread gets to inject a failure */
+	if (__atomic_exchange_n(&has_injected_failure, true, __ATOMIC_ACQ_REL))
+		goto out;
+
+	h = create_hash_entry();
+	h->hash = key.hash;
+	h->hash_hi = key.hash_hi;
+	h->nr_frames = key.nr_frames;
+
+	if (verify_callsites && key.nr_frames) {
+		h->keys = meta_alloc(key.nr_frames * sizeof(keys[0]) * 2);
+		if (!h->keys) {
+			perror(SNAME);
+			exit_error();
+		}
+
+		memcpy(h->keys, keys, key.nr_frames * sizeof(keys[0]) * 2);
+	}
+
+	ret = callsite_insert(h);
+	if (!ret) {
+		meta_free(h->keys);
+		meta_free(h);
+	} else {
+		write_callsite(dbf, h);
+		print_injection(name, stack);
+	}
+
+out:
+	force_libc = false;
+	errno = saved_errno;
+	return ret;
+}
+
+/*
+ * Check the frames against a space separated list of strings, any of
+ * which matching part of a frame's "function+offset" ignores the error.
+ */
+static bool should_ignore_err(const unw_word_t *ips, int nr,
+			      const char *ignore_env,
+			      const char *ignore_all_env)
+{
+	char *ignore_all = getenv(ignore_all_env);
+	char *ignore = getenv(ignore_env);
+	struct scratch *sc = get_scratch();
+	char *name = sc->name, *ignore_cpy, *tok, *save;
+	unw_word_t off;
+	bool ret = false;
+	int i;
+
+	if (ignore_all)
+		return true;
+
+	if (!ignore)
+		return false;
+
+	ignore_cpy = meta_alloc(strlen(ignore) + 1);
+	if (!ignore_cpy) {
+		perror(SNAME);
+		exit_error();
+	}
+
+	for (i = 0; i < nr && !ret; i++) {
+		if (sym_lookup(ips[i], name, sizeof(sc->name), &off) == 0)
+			snprintf(name + strlen(name),
+				 sizeof(sc->name) - strlen(name), "+0x%lx", off);
+		else
+			strcpy(name, "unknown+0x0");
+
+		strcpy(ignore_cpy, ignore);
+		tok = strtok_r(ignore_cpy, " ", &save);
+		while (tok && !ret) {
+			ret = strstr(name, tok) != NULL;
+			tok = strtok_r(NULL, " ", &save);
+		}
+	}
+
+	meta_free(ignore_cpy);
+	return ret;
+}
+
+/*
+ * Each distinct backtrace that resources are created at is stored once
+ * in the stack depot and kept until exit, so the tracking tables only
+ * refer to it. The depot is sharded by the hash of the backtrace like
+ * the tables are. A backtrace's id packs its shard and its index within
+ * the shard, plus one so that zero can mean none.
+ */
+struct depot_shard {
+	struct hash_table table;
+	struct backtrace **records;
+	unsigned int nr;
+	unsigned int alloc;
+};
+
+static struct depot_shard stack_depot[NR_SHARDS] = {
+	[0 ... NR_SHARDS - 1] = { .table = HASH_TABLE_INIT },
+};
 
-		h->hash = djb_hash(name, h->hash);
-	}
+static unsigned long long backtrace_hash(const unw_word_t *ips, int nr)
+{
+	unsigned long long hash = HASH_INIT;
+	int i;
 
-	return h;
-skip:
-	free(h);
-	return NULL;
+	for (i = 0; i < nr; i++)
+		hash = fmix64(hash ^ ips[i]);
+
+	return hash ?: 1;
 }
 
-static void print_backtrace(void)
+/* Must be called with the shard's lock held */
+static struct backtrace *__stack_depot_find(const struct hash_table *t,
+					    unsigned long long hash,
+					    const unw_word_t *ips, int nr)
 {
-	unw_cursor_t cursor;
-	unw_context_t uc;
-	unw_word_t off;
-	char name[4096];
-	int ret;
-
-	unw_getcontext(&uc);
-	unw_init_local(&cursor, &uc);
+	struct backtrace *bt;
+	size_t i;
 
-	/* Ignore the current function */
-	unw_step(&cursor);
+	if (!t->nr)
+		return NULL;
 
-	while (unw_step(&cursor) > 0) {
-		ret = unw_get_proc_name(&cursor, name, sizeof(name), &off);
-		if (ret == 0)
-			fprintf(stderr, "    %s+0x%lx\n", name, off);
-		else
-			fprintf(stderr, "    ?unknown\n");
+	for (i = hash_table_slot(t, hash); t->keys[i];
+	     i = (i + 1) & (t->size - 1)) {
+		bt = t->values[i];
+		if (t->keys[i] == hash && bt->nr == nr &&
+		    !memcmp(bt->ips, ips, nr * sizeof(ips[0])))
+			return bt;
 	}
+
+	return NULL;
 }
 
-static void print_injection(void)
+static void depot_oom(struct depot_shard *d)
 {
-	fprintf(stderr, TAG "Injecting failure at:\n");
-	print_backtrace();
-	fprintf(stderr, "\n");
+	perror(SNAME);
+	pthread_mutex_unlock(&d->table.lock);
+	exit_error();
 }
 
-static bool should_fail(const char *name)
+/* Must be called with force_libc set */
+static const struct backtrace *stack_depot_save(const unw_word_t *ips,
+						int nr)
 {
-	static FILE *dbf = NULL;
-	struct hash_entry *h;
-	bool ret = false;
-
-	if (has_injected_failure)
-		return false;
-
-	force_libc = true;
+	unsigned long long hash = backtrace_hash(ips, nr);
+	unsigned int shard = shard_index(hash);
+	struct depot_shard *d = &stack_depot[shard];
+	struct hash_table *t = &d->table;
+	struct backtrace *bt, **records;
 
-	if (!dbf)
-		dbf = load_database();
+	pthread_mutex_lock(&t->lock);
 
-	h = get_current_callsite();
-	if (!h)
+	bt = __stack_depot_find(t, hash, ips, nr);
+	if (bt)
 		goto out;
 
-	ret = hash_table_insert(h, callsite_table);
-	if (!ret) {
-		free(h);
-	} else {
-		write_callsite(dbf, h);
-		print_injection();
-		has_injected_failure = true;
+	if (d->nr == d->alloc) {
+		records = meta_realloc(d->records,
+				       (d->alloc ? d->alloc * 2 : 64) *
+				       sizeof(*records));
+		if (!records)
+			depot_oom(d);
+
+		d->records = records;
+		d->alloc = d->alloc ? d->alloc * 2 : 64;
 	}
 
+	bt = meta_alloc(sizeof(*bt) + nr * sizeof(bt->ips[0]));
+	if (!bt)
+		depot_oom(d);
+
+	bt->id = (d->nr << SHARD_BITS | shard) + 1;
+	bt->nr = nr;
+	memcpy(bt->ips, ips, nr * sizeof(ips[0]));
+
+	d->records[d->nr++] = bt;
+	__hash_table_add(t, hash, bt);
+
 out:
-	force_libc = false;
-	return ret;
+	pthread_mutex_unlock(&t->lock);
+	return bt;
 }
 
-static bool should_ignore_err(const char *backtrace, const char *ignore_env,
-			      const char *ignore_all_env)
+static const struct backtrace *stack_depot_get(unsigned int id)
 {
-	char *ignore_all = getenv(ignore_all_env);
-	char *ignore = getenv(ignore_env);
-	char *ignore_cpy, *tok;
+	struct depot_shard *d = &stack_depot[(id - 1) & (NR_SHARDS - 1)];
+	unsigned int i = (id - 1) >> SHARD_BITS;
+	const struct backtrace *bt = NULL;
 
-	if (ignore_all)
-		return true;
+	pthread_mutex_lock(&d->table.lock);
+	if (id && i < d->nr)
+		bt = d->records[i];
+	pthread_mutex_unlock(&d->table.lock);
 
-	if (!ignore)
-		return false;
+	return bt;
+}
 
-	ignore_cpy = strdup(ignore);
-	if (!ignore_cpy) {
-		perror(SNAME);
-		exit_error();
-	}
+/*
+ * Open file descriptors are tracked in a table indexed by the fd which
+ * holds the depot id of the backtrace each was opened at, or zero. It is
+ * made of chunks allocated as higher fds show up, so it grows without
+ * ever moving and each slot is updated with a single atomic operation
+ * rather than under a lock. The directory covers the kernel's maximum
+ * RLIMIT_NOFILE.
+ */
+#define FD_CHUNK_BITS 12
+#define FD_CHUNK_SIZE (1 << FD_CHUNK_BITS)
+#define FD_MAX (1 << 30)
 
-	tok = strtok(ignore, " ");
-	while (tok) {
-		if (strstr(backtrace, tok)) {
-			free(ignore_cpy);
-			return true;
+static unsigned int *fd_chunks[FD_MAX >> FD_CHUNK_BITS];
+
+/* Must be called with force_libc set if create is */
+static unsigned int *fd_slot(int fd, bool create)
+{
+	unsigned int **chunk, *c, *new;
+
+	if (fd < 0 || fd >= FD_MAX)
+		return NULL;
+
+	chunk = &fd_chunks[fd >> FD_CHUNK_BITS];
+	c = __atomic_load_n(chunk, __ATOMIC_ACQUIRE);
+	if (!c && create) {
+		new = meta_alloc(FD_CHUNK_SIZE * sizeof(*new));
+		if (!new) {
+			perror(SNAME);
+			exit_error();
 		}
 
-		tok = strtok(NULL, " ");
+		if (__atomic_compare_exchange_n(chunk, &c, new, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE))
+			c = new;
+		else
+			meta_free(new);
 	}
 
-	free(ignore_cpy);
-	return false;
+	return c ? &c[fd & (FD_CHUNK_SIZE - 1)] : NULL;
 }
 
-static char *get_backtrace_string(void)
+/* Must be called with force_libc set */
+static void report_untracked(unsigned long long key, struct stack *stack,
+			     const char *ignore_env, const char *ignore_all_env,
+			     const char *msg)
 {
-	char name[4096], backtrace[4096];
-	unw_cursor_t cursor;
-	unw_context_t uc;
-	unw_word_t off;
-	char *retstr;
-	int boff = 0;
-	int ret;
-
-	unw_getcontext(&uc);
-	unw_init_local(&cursor, &uc);
+	struct stack local;
 
-	while (unw_step(&cursor) > 0) {
-		ret = unw_get_proc_name(&cursor, name, sizeof(name), &off);
-		if (ret != 0)
-			strcpy(name, "unknown");
-
-		boff += snprintf(backtrace + boff, sizeof(backtrace) - boff,
-				 "    %s+0x%lx\n", name, off);
+	if (!stack) {
+		stack_init(&local);
+		stack = &local;
 	}
 
-	retstr = strdup(backtrace);
-	if (!retstr) {
-		perror(SNAME);
-		exit_error();
+	stack_capture(stack);
+	if (!should_ignore_err(stack->ips, stack->nr, ignore_env,
+			       ignore_all_env)) {
+		print_report(stack->ips, stack->nr, msg, key);
+		found_bug = true;
 	}
-
-	return retstr;
 }
 
-static void track_create(unsigned long long hash,
-			 struct hash_entry **table)
+static void track_create(unsigned long long hash, struct hash_table *table,
+			 struct stack *stack)
 {
-	struct hash_entry *h;
+	int saved_errno = errno;
+	const struct backtrace *bt;
 
 	if (force_libc || !hash)
 		return;
 
 	force_libc = true;
 
-	h = create_hash_entry();
-	h->backtrace = get_backtrace_string();
-	h->hash = hash;
-	hash_table_insert(h, table);
+	stack_capture(stack);
+	bt = stack_depot_save(stack->ips, stack->nr);
+	hash_table_insert(hash_shard(table, hash), hash, (void *)bt);
 
 	force_libc = false;
+	errno = saved_errno;
 }
 
-static void track_destroy(unsigned long long hash, struct hash_entry **table,
-			  const char *ignore_env, const char *ignore_all_env,
-			  const char *msg)
+static void track_destroy(unsigned long long hash, struct hash_table *table,
+			  struct stack *stack, const char *ignore_env,
+			  const char *ignore_all_env, const char *msg)
 {
-	struct hash_entry *h;
-	char *backtrace;
+	int saved_errno = errno;
 
 	if (force_libc || !hash)
 		return;
 
 	force_libc = true;
 
-	h = hash_table_pop(hash, table);
-	if (!h) {
-		backtrace = get_backtrace_string();
-		if (!should_ignore_err(backtrace, ignore_env,
-				       ignore_all_env)) {
-			fprintf(stderr, msg, hash);
-			print_backtrace();
-			found_bug = true;
-		}
-		free(backtrace);
-	} else {
-		free(h->backtrace);
-		free(h);
-	}
+	if (!hash_table_pop(hash_shard(table, hash), hash, NULL))
+		report_untracked(hash, stack, ignore_env, ignore_all_env, msg);
+
+	force_libc = false;
+	errno = saved_errno;
+}
+
+static void track_fd_create(int fd, struct stack *stack)
+{
+	int saved_errno = errno;
+	unsigned int *slot, id, old = 0;
+
+	if (force_libc || fd <= 0)
+		return;
+
+	force_libc = true;
+
+	stack_capture(stack);
+	id = stack_depot_save(stack->ips, stack->nr)->id;
+
+	/* an fd already tracked keeps where it was first seen opened */
+	slot = fd_slot(fd, true);
+	if (slot)
+		__atomic_compare_exchange_n(slot, &old, id, false,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+
+	force_libc = false;
+	errno = saved_errno;
+}
+
+static void track_fd_destroy(int fd, struct stack *stack,
+			     const char *ignore_env,
+			     const char *ignore_all_env, const char *msg)
+{
+	int saved_errno = errno;
+	unsigned int *slot;
+
+	if (force_libc || !fd)
+		return;
+
+	slot = fd_slot(fd, false);
+	if (slot && __atomic_exchange_n(slot, 0, __ATOMIC_ACQ_REL))
+		return;
 
+	force_libc = true;
+	report_untracked(fd, stack, ignore_env, ignore_all_env, msg);
 	force_libc = false;
+	errno = saved_errno;
 }
 
 static void *early_allocator(size_t size)
@@ -535,8 +3306,24 @@ static void *early_allocator(size_t size)
 	force_libc = last_force_libc; \
 })
 
-#define handle_call(name, ret_type, err_ret, err_errno, ...) ({ \
-	if (!force_libc && should_fail(#name)) { \
+/*
+ * Like call_super() but leaves force_libc alone, for functions that run
+ * the program's own code, whose calls must still be tracked and failed.
+ */
+#define call_next(name, ret_type, ...) ({ \
+	static ret_type (*__next)(); \
+	if (!__next) { \
+		use_early_allocator = true; \
+		__next = dlsym(RTLD_NEXT, #name); \
+		use_early_allocator = false; \
+	} \
+	__next(__VA_ARGS__); \
+})
+
+#define handle_call(name, stack, ret_type, err_ret, err_errno, ...) ({ \
+	if (!force_libc && \
+	    should_fail(#name, context_depth_of(name), \
+			__builtin_return_address(0), stack)) { \
 		errno = err_errno; \
 		return err_ret; \
 	} \
@@ -546,7 +3333,9 @@ static void *early_allocator(size_t size)
 #define handle_call_close(name, ret_type, err_ret, err_errno, ...) ({ \
 	ret_type ret; \
 	ret = call_super(name, ret_type, __VA_ARGS__); \
-	if (!ret && !force_libc && should_fail(#name)) { \
+	if (!ret && !force_libc && \
+	    should_fail(#name, context_depth_of(name), \
+			__builtin_return_address(0), NULL)) { \
 		errno = err_errno; \
 		ret = err_ret; \
 	} \
@@ -555,6 +3344,7 @@ static void *early_allocator(size_t size)
 
 void *malloc(size_t size)
 {
+	struct stack stack;
 	void *ret;
 
 	/*
@@ -564,38 +3354,46 @@ void *malloc(size_t size)
 	if (use_early_allocator)
 		return early_allocator(size); /* LCOV_EXCL_LINE */
 
-	ret = handle_call(malloc, void *, NULL, ENOMEM, size);
+	stack_init(&stack);
+
+	ret = handle_call(malloc, &stack, void *, NULL, ENOMEM, size);
 	if (ret)
-		track_create((intptr_t)ret, allocation_table);
+		track_create((intptr_t)ret, allocation_table, &stack);
 
 	return ret;
 }
 
 void *calloc(size_t nmemb, size_t size)
 {
+	struct stack stack;
 	void *ret;
 
 	if (use_early_allocator)
 		return early_allocator(nmemb * size);
 
-	ret = handle_call(calloc, void *, NULL, ENOMEM, nmemb, size);
+	stack_init(&stack);
+
+	ret = handle_call(calloc, &stack, void *, NULL, ENOMEM, nmemb, size);
 	if (ret)
-		track_create((intptr_t)ret, allocation_table);
+		track_create((intptr_t)ret, allocation_table, &stack);
 
 	return ret;
 }
 
 void *realloc(void *ptr, size_t size)
 {
+	struct stack stack;
 	void *ret;
 
-	ret = handle_call(realloc, void *, NULL, ENOMEM, ptr, size);
+	stack_init(&stack);
+
+	ret = handle_call(realloc, &stack, void *, NULL, ENOMEM, ptr, size);
 	if (ret) {
 		track_destroy((intptr_t)ptr, allocation_table,
-			      PFX "IGNORE_UNTRACKED_FREES",
+			      &stack, PFX "IGNORE_UNTRACKED_FREES",
 			      PFX "IGNORE_ALL_UNTRACKED_FREES",
 			      TAG "Attempted to realloc untracked pointer 0x%llx at:\n");
-		track_create((intptr_t)ret, allocation_table);
+		track_create((intptr_t)ret, allocation_table, &stack);
 	}
 
 	return ret;
@@ -605,98 +3403,112 @@ void free(void *ptr)
 {
 	call_super_void(free, ptr);
 	track_destroy((intptr_t)ptr, allocation_table,
-		      PFX "IGNORE_UNTRACKED_FREES",
+		      NULL, PFX "IGNORE_UNTRACKED_FREES",
 		      PFX "IGNORE_ALL_UNTRACKED_FREES",
 		      TAG "Attempted to free untracked pointer 0x%llx at:\n");
 }
 
 int creat(const char *pathname, mode_t mode)
 {
+	struct stack stack;
 	int fd;
 
-	fd = handle_call(creat, int, -1, EACCES, pathname, mode);
+	stack_init(&stack);
+
+	fd = handle_call(creat, &stack, int, -1, EACCES, pathname, mode);
 	if (fd != -1)
-		track_create(fd, fd_table);
+		track_fd_create(fd, &stack);
 
 	return fd;
 }
 
 int open(const char *pathname, int flags, ...)
 {
+	struct stack stack;
 	va_list ap;
 	mode_t mode;
 	int fd;
 
+	stack_init(&stack);
+
 	va_start(ap, flags);
 	mode = va_arg(ap, mode_t);
 	va_end(ap);
 
-	fd = handle_call(open, int, -1, EACCES, pathname, flags, mode);
+	fd = handle_call(open, &stack, int, -1, EACCES, pathname, flags, mode);
 	if (fd != -1)
-		track_create(fd, fd_table);
+		track_fd_create(fd, &stack);
 
 	return fd;
 }
 
 int openat(int dirfd, const char *pathname, int flags, ...)
 {
+	struct stack stack;
 	va_list ap;
 	mode_t mode;
 	int fd;
 
+	stack_init(&stack);
+
 	va_start(ap, flags);
 	mode = va_arg(ap, mode_t);
 	va_end(ap);
 
-	fd = handle_call(openat, int, -1, EACCES, dirfd, pathname, flags,
+	fd = handle_call(openat, &stack, int, -1, EACCES, dirfd, pathname,
+			 flags,
 			 mode);
 	if (fd != -1)
-		track_create(fd, fd_table);
+		track_fd_create(fd, &stack);
 
 	return fd;
 }
 
 int close(int fd)
 {
-	track_destroy(fd, fd_table,
-		      PFX "IGNORE_UNTRACKED_CLOSES",
-		      PFX "IGNORE_ALL_UNTRACKED_CLOSES",
-		      TAG "Attempted to close untracked file descriptor %lld at:\n");
+	track_fd_destroy(fd, NULL, PFX "IGNORE_UNTRACKED_CLOSES",
+			 PFX "IGNORE_ALL_UNTRACKED_CLOSES",
+			 TAG "Attempted to close untracked file descriptor %lld at:\n");
 	return handle_call_close(close, int, -1, EDQUOT, fd);
 }
 
 ssize_t read(int fd, void *buf, size_t count)
 {
-	return handle_call(read, int, -1, EIO, fd, buf, count);
+	return handle_call(read, NULL, int, -1, EIO, fd, buf, count);
 }
 
 ssize_t write(int fd, const void *buf, size_t count)
 {
-	return handle_call(write, int, -1, ENOSPC, fd, buf, count);
+	return handle_call(write, NULL, int, -1, ENOSPC, fd, buf, count);
 }
 
 FILE *fopen(const char *pathname, const char *mode)
 {
+	struct stack stack;
 	FILE *f;
 
-	f = handle_call(fopen, FILE *, NULL, EACCES, pathname, mode);
+	stack_init(&stack);
+
+	f = handle_call(fopen, &stack, FILE *, NULL, EACCES, pathname, mode);
 	if (f)
-		track_create((intptr_t)f, file_table);
+		track_create((intptr_t)f, file_table, &stack);
 
 	return f;
 }
 
 FILE *fdopen(int fd, const char *mode)
 {
+	struct stack stack;
 	FILE *f;
 
-	f = handle_call(fdopen, FILE *, NULL, EPERM, fd, mode);
+	stack_init(&stack);
+
+	f = handle_call(fdopen, &stack, FILE *, NULL, EPERM, fd, mode);
 	if (f) {
-		track_create((intptr_t)f, file_table);
-		track_destroy(fd, fd_table,
-			      PFX "IGNORE_UNTRACKED_FCLOSES",
-			      PFX "IGNORE_ALL_UNTRACKED_FCLOSES",
-			      TAG "Attempted to fdopen untracked file descriptor %lld at:\n");
+		track_create((intptr_t)f, file_table, &stack);
+		track_fd_destroy(fd, &stack, PFX "IGNORE_UNTRACKED_FCLOSES",
+				 PFX "IGNORE_ALL_UNTRACKED_FCLOSES",
+				 TAG "Attempted to fdopen untracked file descriptor %lld at:\n");
 	}
 
 	return f;
@@ -704,22 +3516,29 @@ FILE *fdopen(int fd, const char *mode)
 
 FILE *fmemopen(void *buf, size_t size, const char *mode)
 {
+	struct stack stack;
 	FILE *f;
 
-	f = handle_call(fmemopen, FILE *, NULL, ENOMEM, buf, size, mode);
+	stack_init(&stack);
+
+	f = handle_call(fmemopen, &stack, FILE *, NULL, ENOMEM, buf, size,
+			mode);
 	if (f)
-		track_create((intptr_t)f, file_table);
+		track_create((intptr_t)f, file_table, &stack);
 
 	return f;
 }
 
 FILE *tmpfile(void)
 {
+	struct stack stack;
 	FILE *f;
 
-	f = handle_call(tmpfile, FILE *, NULL, EROFS);
+	stack_init(&stack);
+
+	f = handle_call(tmpfile, &stack, FILE *, NULL, EROFS);
 	if (f)
-		track_create((intptr_t)f, file_table);
+		track_create((intptr_t)f, file_table, &stack);
 
 	return f;
 }
@@ -727,7 +3546,7 @@ FILE *tmpfile(void)
 int fclose(FILE *stream)
 {
 	track_destroy((intptr_t)stream, file_table,
-		      PFX "IGNORE_UNTRACKED_FCLOSES",
+		      NULL, PFX "IGNORE_UNTRACKED_FCLOSES",
 		      PFX "IGNORE_ALL_UNTRACKED_FCLOSES",
 		      TAG "Attempted to fclose untracked file 0x%llx at:\n");
 	return handle_call_close(fclose, int, EOF, ENOSPC, stream);
@@ -735,20 +3554,13 @@ int fclose(FILE *stream)
 
 int fcloseall(void)
 {
-	struct hash_entry *h;
 	int i;
 
 	force_libc = true;
-	for (i = 0; i < HASH_TABLE_SIZE; i++) {
-		h = file_table[i];
-		while (h) {
-			free(h->backtrace);
-			free(h);
-
-			h = h->next;
-		}
-
-		file_table[i] = NULL;
+	for (i = 0; i < NR_SHARDS; i++) {
+		pthread_mutex_lock(&file_table[i].lock);
+		__hash_table_clear(&file_table[i]);
+		pthread_mutex_unlock(&file_table[i].lock);
 	}
 	force_libc = false;
 
@@ -757,24 +3569,23 @@ int fcloseall(void)
 
 size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
 {
-	return handle_call(fwrite, size_t, 0, ENOSPC, ptr, size, nmemb,
+	return handle_call(fwrite, NULL, size_t, 0, ENOSPC, ptr, size, nmemb,
 			   stream);
 }
 
 static void flag_ferror(FILE *stream)
 {
-	struct hash_entry *h;
-
 	force_libc = true;
-	h = create_hash_entry();
-	h->hash = (intptr_t)stream;
-	hash_table_insert(h, ferror_table);
+	hash_table_insert(hash_shard(ferror_table, (intptr_t)stream),
+			  (intptr_t)stream, NULL);
 	force_libc = false;
 }
 
 size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
 {
-	if (!force_libc && should_fail("fread")) {
+	if (!force_libc &&
+	    should_fail("fread", context_depth_of(fread),
+			__builtin_return_address(0), NULL)) {
 		flag_ferror(stream);
 		errno = EIO;
 		return 0;
@@ -786,15 +3597,19 @@ size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
 ssize_t getline(char **lineptr, size_t *n, FILE *stream)
 {
 	char *old = *lineptr;
+	struct stack stack;
 	ssize_t ret;
 
-	ret = handle_call(getline, ssize_t, -1, ENOMEM, lineptr, n, stream);
+	stack_init(&stack);
+
+	ret = handle_call(getline, &stack, ssize_t, -1, ENOMEM, lineptr, n,
+			  stream);
 	if (old != *lineptr) {
 		track_destroy((intptr_t)old, allocation_table,
-			      PFX "IGNORE_UNTRACKED_FREES",
+			      &stack, PFX "IGNORE_UNTRACKED_FREES",
 			      PFX "IGNORE_ALL_UNTRACKED_FREES",
 			      TAG "Attempted to  untracked pointer 0x%llx at:\n");
-		track_create((intptr_t)*lineptr, allocation_table);
+		track_create((intptr_t)*lineptr, allocation_table, &stack);
 	}
 
 	return ret;
@@ -803,16 +3618,19 @@ ssize_t getline(char **lineptr, size_t *n, FILE *stream)
 ssize_t __getdelim(char **lineptr, size_t *n, int delim, FILE *stream)
 {
 	char *old = *lineptr;
+	struct stack stack;
 	ssize_t ret;
 
-	ret = handle_call(__getdelim, ssize_t, -1, ENOMEM, lineptr, n,
+	stack_init(&stack);
+
+	ret = handle_call(__getdelim, &stack, ssize_t, -1, ENOMEM, lineptr, n,
 			  delim, stream);
 	if (old != *lineptr) {
 		track_destroy((intptr_t)old, allocation_table,
-			      PFX "IGNORE_UNTRACKED_FREES",
+			      &stack, PFX "IGNORE_UNTRACKED_FREES",
 			      PFX "IGNORE_ALL_UNTRACKED_FREES",
 			      TAG "Attempted to realloc untracked pointer 0x%llx at:\n");
-		track_create((intptr_t)*lineptr, allocation_table);
+		track_create((intptr_t)*lineptr, allocation_table, &stack);
 	}
 
 	return ret;
@@ -821,16 +3639,19 @@ ssize_t __getdelim(char **lineptr, size_t *n, int delim, FILE *stream)
 ssize_t getdelim(char **lineptr, size_t *n, int delim, FILE *stream)
 {
 	char *old = *lineptr;
+	struct stack stack;
 	ssize_t ret;
 
-	ret = handle_call(getdelim, ssize_t, -1, ENOMEM, lineptr, n,
+	stack_init(&stack);
+
+	ret = handle_call(getdelim, &stack, ssize_t, -1, ENOMEM, lineptr, n,
 			  delim, stream);
 	if (old != *lineptr) {
 		track_destroy((intptr_t)old, allocation_table,
-			      PFX "IGNORE_UNTRACKED_FREES",
+			      &stack, PFX "IGNORE_UNTRACKED_FREES",
 			      PFX "IGNORE_ALL_UNTRACKED_FREES",
 			      TAG "Attempted to realloc untracked pointer 0x%llx at:\n");
-		track_create((intptr_t)*lineptr, allocation_table);
+		track_create((intptr_t)*lineptr, allocation_table, &stack);
 	}
 
 	return ret;
@@ -838,7 +3659,9 @@ ssize_t getdelim(char **lineptr, size_t *n, int delim, FILE *stream)
 
 int ferror(FILE *stream)
 {
-	if (!force_libc && hash_table_find((intptr_t)stream, ferror_table))
+	if (!force_libc &&
+	    hash_table_find(hash_shard(ferror_table, (intptr_t)stream),
+			    (intptr_t)stream))
 		return 1;
 
 	return call_super(ferror, int, stream);
@@ -846,11 +3669,11 @@ int ferror(FILE *stream)
 
 void clearerr(FILE *stream)
 {
-	struct hash_entry *h;
-
 	if (!force_libc) {
-		h = hash_table_pop((intptr_t)stream, ferror_table);
-		free(h);
+		force_libc = true;
+		hash_table_pop(hash_shard(ferror_table, (intptr_t)stream),
+			       (intptr_t)stream, NULL);
+		force_libc = false;
 	}
 
 	call_super_void(clearerr, stream);
@@ -858,7 +3681,7 @@ void clearerr(FILE *stream)
 
 int fflush(FILE *stream)
 {
-	return handle_call(fflush, int, EOF, ENOSPC, stream);
+	return handle_call(fflush, NULL, int, EOF, ENOSPC, stream);
 }
 
 int fputc(int c, FILE *stream)
@@ -944,12 +3767,14 @@ int sscanf(const char *str, const char *format, ...)
 
 int vsscanf(const char *str, const char *format, va_list ap)
 {
-	return handle_call(vsscanf, int, -1, ENOMEM, str, format, ap);
+	return handle_call(vsscanf, NULL, int, -1, ENOMEM, str, format, ap);
 }
 
 int vfscanf(FILE *stream, const char *format, va_list ap)
 {
-	if (!force_libc && should_fail("vfscanf")) {
+	if (!force_libc &&
+	    should_fail("vfscanf", context_depth_of(vfscanf),
+			__builtin_return_address(0), NULL)) {
 		flag_ferror(stream);
 		errno = EIO;
 		return EOF;
@@ -966,12 +3791,15 @@ int vfscanf(FILE *stream, const char *format, va_list ap)
  */
 int __isoc99_vsscanf(const char *str, const char *format, va_list ap)
 {
-	return handle_call(__isoc99_vsscanf, int, -1, ENOMEM, str, format, ap);
+	return handle_call(__isoc99_vsscanf, NULL, int, -1, ENOMEM, str, format,
+			   ap);
 }
 
 int __isoc99_vfscanf(FILE *stream, const char *format, va_list ap)
 {
-	if (!force_libc && should_fail("vfscanf")) {
+	if (!force_libc &&
+	    should_fail("vfscanf", context_depth_of(vfscanf),
+			__builtin_return_address(0), NULL)) {
 		flag_ferror(stream);
 		errno = EIO;
 		return EOF;
@@ -1007,18 +3835,45 @@ int __isoc99_fscanf(FILE *stream, const char *format, ...)
 
 int mprotect(void *addr, size_t len, int prot)
 {
-	return handle_call(mprotect, int, -1, ENOMEM, addr, len, prot);
+	return handle_call(mprotect, NULL, int, -1, ENOMEM, addr, len, prot);
 }
 
 void *mmap(void *addr, size_t length, int prot, int flags, int fd,
 	   off_t offset)
 {
+	struct stack stack;
 	void *ret;
 
-	ret = handle_call(mmap, void *, MAP_FAILED, ENOMEM, addr, length, prot,
-			  flags, fd, offset);
+	stack_init(&stack);
+
+	ret = handle_call(mmap, &stack, void *, MAP_FAILED, ENOMEM, addr,
+			  length, prot, flags, fd, offset);
 	if (ret != MAP_FAILED)
-		track_create((intptr_t)ret, allocation_table);
+		track_create((intptr_t)ret, allocation_table, &stack);
+
+	return ret;
+}
+
+/*
+ * libunwind maps its per-thread caches while the library is unwinding,
+ * so they are never tracked, and unmaps them from a thread-specific data
+ * destructor once the thread exits.
+ */
+static bool is_unwinder_caller(void *caller)
+{
+	struct module_map *map;
+	struct module *m;
+	bool ret;
+
+	if (force_libc)
+		return false;
+
+	force_libc = true;
+	map = map_enter();
+	m = module_find(map, (unw_word_t)caller - 1);
+	ret = m && m == module_find(map, (unw_word_t)unw_init_local);
+	map_exit();
+	force_libc = false;
 
 	return ret;
 }
@@ -1026,8 +3881,11 @@ void *mmap(void *addr, size_t length, int prot, int flags, int fd,
 int munmap(void *addr, size_t length)
 {
 	call_super_void(munmap, addr, length);
+	if (is_unwinder_caller(__builtin_return_address(0)))
+		return 0;
+
 	track_destroy((intptr_t)addr, allocation_table,
-		      PFX "IGNORE_UNTRACKED_FREES",
+		      NULL, PFX "IGNORE_UNTRACKED_FREES",
 		      PFX "IGNORE_ALL_UNTRACKED_FREES",
 		      TAG "Attempted to munmap untracked pointer 0x%llx at:\n");
 	return 0;
@@ -1037,59 +3895,318 @@ long syscall(long int syscall_number, long int arg1, long int arg2,
 	     long int arg3, long int arg4, long int arg5, long int arg6,
 	     long int arg7)
 {
-	return handle_call(syscall, long, -1, ENOTSUP, syscall_number,
+	return handle_call(syscall, NULL, long, -1, ENOTSUP, syscall_number,
 			   arg1, arg2, arg3, arg4, arg5, arg6, arg7);
 }
 
-static void print_leak(struct hash_entry *h, const char *msg)
+void *dlopen(const char *filename, int flags)
 {
-	found_bug = true;
-	fprintf(stderr, msg, h->hash);
-	fprintf(stderr, "%s", h->backtrace);
+	void *ret;
+
+	/* constructors of the loaded modules run in here */
+	ret = call_next(dlopen, void *, filename, flags);
+	if (ret)
+		flush_caches(false);
+
+	return ret;
 }
 
-static void hdl_leaks(struct hash_entry *h, const char *ignore_env,
-		      const char *ignore_all_env, const char *msg)
+int dlclose(void *handle)
 {
-	while (h) {
-		if (msg && !should_ignore_err(h->backtrace, ignore_env,
-					      ignore_all_env))
-			print_leak(h, msg);
+	int ret;
+
+	/* and their destructors in here */
+	ret = call_next(dlclose, int, handle);
+	flush_caches(true);
+
+	return ret;
+}
 
-		free(h->backtrace);
-		free(h);
+/*
+ * Hash of the stack calling the function that creates a thread or
+ * fiber, mixed with the origin of its creator. Must be called with the
+ * database open.
+ */
+static unsigned long long spawn_hash(void *caller, unsigned long long origin)
+{
+	struct hash_entry key = {};
+	struct stack stack;
 
-		h = h->next;
+	force_libc = true;
+	key.hash = HASH_INIT;
+	if (callsite_id == CALLSITE_ID_SHADOW) {
+		shadow_hash((unw_word_t)caller, &key);
+	} else {
+		stack_init(&stack);
+		stack_capture(&stack);
+		stack_hash(&stack, MAX_FRAMES, &key);
 	}
+	force_libc = false;
+
+	return fmix64(key.hash ^ origin);
 }
 
-__attribute__((destructor))
-static void check_leaks(void)
+struct thread_start {
+	void *(*fn)(void *);
+	void *arg;
+	unsigned long long origin;
+};
+
+static void *thread_trampoline(void *data)
 {
-	int i;
+	struct thread_start ts = *(struct thread_start *)data;
+
+	force_libc = true;
+	meta_free(data);
+	force_libc = false;
+	thread_origin = ts.origin;
+
+	return ts.fn(ts.arg);
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+		   void *(*fn)(void *), void *arg)
+{
+	struct thread_start *ts;
+	int ret;
+
+	if (!force_libc) {
+		force_libc = true;
+		open_database();
+		force_libc = false;
+	}
+
+	/* what glibc allocates for the thread is tracked and may fail */
+	if (force_libc || !mix_thread_origin)
+		return call_next(pthread_create, int, thread, attr, fn, arg);
+
+	force_libc = true;
+	ts = meta_alloc(sizeof(*ts));
+	force_libc = false;
+	if (!ts)
+		return EAGAIN;
+
+	ts->fn = fn;
+	ts->arg = arg;
+	ts->origin = spawn_hash(__builtin_return_address(0), thread_origin);
+
+	ret = call_next(pthread_create, int, thread, attr, thread_trampoline,
+			ts);
+	if (ret) {
+		force_libc = true;
+		meta_free(ts);
+		force_libc = false;
+	}
+
+	return ret;
+}
+
+int pthread_setname_np(pthread_t thread, const char *name)
+{
+	int ret;
+
+	ret = call_super(pthread_setname_np, int, thread, name);
+	__atomic_add_fetch(&role_gen, 1, __ATOMIC_RELEASE);
+
+	return ret;
+}
+
+/*
+ * With FAILINJ_FIBER_ORIGIN, makecontext() starts each fiber through
+ * failinj_fiber_entry(), which records the hash of the stack that made
+ * the context and is an anchor frame. Unwinding in a fiber then stops
+ * at its entry, however deep the scheduler that runs it is, and the
+ * fiber's origin is mixed in instead of what lies below. The frame
+ * pointer unwinder uses the fiber's stack as the bounds of its walk.
+ *
+ * swapcontext() brings back the origin and stack bounds of the context
+ * that is resumed, as they are kept in the frame of the swapcontext()
+ * call that suspended it. Contexts resumed by setcontext() or saved by
+ * getcontext() alone keep the state of the context switching to them.
+ */
+#define MAX_FIBER_ARGS 16
+
+typedef void fiber_fn(long, long, long, long, long, long, long, long,
+		      long, long, long, long, long, long, long, long);
+
+struct fiber_start {
+	fiber_fn *fn;
+	long args[MAX_FIBER_ARGS];
+	unsigned long long origin;
+	unw_word_t stack_lo;
+	unw_word_t stack_hi;
+};
+
+__attribute__((noinline))
+static void failinj_fiber_entry(unsigned int hi, unsigned int lo)
+{
+	struct fiber_start *data = (void *)((uintptr_t)hi << 32 | lo);
+	struct fiber_start fs = *data;
+	long *a = fs.args;
 
 	force_libc = true;
+	meta_free(data);
+	force_libc = false;
+	fiber_origin = fs.origin;
+	stack_lo = fs.stack_lo;
+	stack_hi = fs.stack_hi;
+
+	fs.fn(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9],
+	      a[10], a[11], a[12], a[13], a[14], a[15]);
+}
+
+void makecontext(ucontext_t *ucp, void (*fn)(void), int argc, ...)
+{
+	struct fiber_start *fs;
+	long args[MAX_FIBER_ARGS] = {};
+	long *a = args;
+	uintptr_t ptr;
+	va_list ap;
+	int i;
+
+	if (argc > MAX_FIBER_ARGS) {
+		fprintf(stderr, TAG "makecontext() with more than %d arguments "
+			"is not supported\n", MAX_FIBER_ARGS);
+		exit_error();
+	}
+
+	va_start(ap, argc);
+	for (i = 0; i < argc; i++)
+		args[i] = va_arg(ap, long);
+	va_end(ap);
+
+	if (!force_libc) {
+		force_libc = true;
+		open_database();
+		force_libc = false;
+	}
+
+	fs = NULL;
+	if (!force_libc && mix_fiber_origin) {
+		force_libc = true;
+		fs = meta_alloc(sizeof(*fs));
+		force_libc = false;
+	}
+
+	if (!fs) {
+		call_super_void(makecontext, ucp, fn, argc, a[0], a[1], a[2],
+				a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10],
+				a[11], a[12], a[13], a[14], a[15]);
+		return;
+	}
+
+	fs->fn = (fiber_fn *)fn;
+	memcpy(fs->args, args, sizeof(args));
+	fs->origin = spawn_hash(__builtin_return_address(0), fiber_origin);
+	fs->stack_lo = (unw_word_t)ucp->uc_stack.ss_sp;
+	fs->stack_hi = fs->stack_lo + ucp->uc_stack.ss_size;
+
+	ptr = (uintptr_t)fs;
+	call_super_void(makecontext, ucp, (void (*)(void))failinj_fiber_entry,
+			2, (unsigned int)(ptr >> 32), (unsigned int)ptr);
+}
+
+/*
+ * Not through call_super() as that would leave force_libc set in the
+ * context switched to.
+ */
+int swapcontext(ucontext_t *oucp, const ucontext_t *ucp)
+{
+	static int (*super)(ucontext_t *, const ucontext_t *);
+	unsigned long long origin = fiber_origin;
+	unw_word_t lo = stack_lo, hi = stack_hi;
+	int ret;
+
+	if (!super) {
+		use_early_allocator = true;
+		super = dlsym(RTLD_NEXT, "swapcontext");
+		use_early_allocator = false;
+	}
+
+	ret = super(oucp, ucp);
+
+	fiber_origin = origin;
+	stack_lo = lo;
+	stack_hi = hi;
+
+	return ret;
+}
+
+static void report_leak(const struct backtrace *bt, unsigned long long key,
+			const char *ignore_env, const char *ignore_all_env,
+			const char *msg)
+{
+	if (!should_ignore_err(bt ? bt->ips : NULL, bt ? bt->nr : 0,
+			       ignore_env, ignore_all_env)) {
+		found_bug = true;
+		print_report(bt ? bt->ips : NULL, bt ? bt->nr : 0, msg, key);
+	}
+}
+
+static void hdl_leaks(struct hash_table *shards, const char *ignore_env,
+		      const char *ignore_all_env, const char *msg)
+{
+	struct hash_table *t;
+	size_t i;
+
+	for (t = shards; t < shards + NR_SHARDS; t++) {
+		pthread_mutex_lock(&t->lock);
+		for (i = 0; i < t->size; i++)
+			if (t->keys[i])
+				report_leak(t->values[i], t->keys[i],
+					    ignore_env, ignore_all_env, msg);
+
+		__hash_table_clear(t);
+		pthread_mutex_unlock(&t->lock);
+	}
+}
 
-	pthread_mutex_lock(&hash_table_mutex);
-	for (i = 0; i < HASH_TABLE_SIZE; i++) {
-		hdl_leaks(allocation_table[i], PFX "IGNORE_MEM_LEAKS",
-			  PFX "IGNORE_ALL_MEM_LEAKS",
-			  TAG "Possible memory leak for 0x%llx allocated at:\n");
-		allocation_table[i] = NULL;
+static void hdl_fd_leaks(const char *ignore_env, const char *ignore_all_env,
+			 const char *msg)
+{
+	unsigned int *c, id;
+	size_t i, j;
+
+	for (i = 0; i < ARRAY_SIZE(fd_chunks); i++) {
+		c = __atomic_load_n(&fd_chunks[i], __ATOMIC_ACQUIRE);
+		for (j = 0; c && j < FD_CHUNK_SIZE; j++) {
+			id = __atomic_exchange_n(&c[j], 0, __ATOMIC_ACQ_REL);
+			if (id)
+				report_leak(stack_depot_get(id),
+					    i << FD_CHUNK_BITS | j,
+					    ignore_env, ignore_all_env, msg);
+		}
+	}
+}
 
-		hdl_leaks(fd_table[i], PFX "IGNORE_FD_LEAKS",
-			  PFX "IGNORE_ALL_FD_LEAKS",
-			  TAG "Possible file descriptor leak for %lld opened at:\n");
-		fd_table[i] = NULL;
+__attribute__((destructor))
+static void check_leaks(void)
+{
+	int i;
 
-		hdl_leaks(file_table[i], PFX "IGNORE_FILE_LEAKS",
-			  PFX "IGNORE_ALL_FILE_LEAKS",
-			  TAG "Possible unclosed file for 0x%llx opened at:\n");
-		file_table[i] = NULL;
+	force_libc = true;
 
-		hdl_leaks(ferror_table[i], NULL, NULL, NULL);
+	hdl_leaks(allocation_table, PFX "IGNORE_MEM_LEAKS",
+		  PFX "IGNORE_ALL_MEM_LEAKS",
+		  TAG "Possible memory leak for 0x%llx allocated at:\n");
+	hdl_fd_leaks(PFX "IGNORE_FD_LEAKS", PFX "IGNORE_ALL_FD_LEAKS",
+		     TAG "Possible file descriptor leak for %lld opened at:\n");
+	hdl_leaks(file_table, PFX "IGNORE_FILE_LEAKS",
+		  PFX "IGNORE_ALL_FILE_LEAKS",
+		  TAG "Possible unclosed file for 0x%llx opened at:\n");
+	for (i = 0; i < NR_SHARDS; i++) {
+		pthread_mutex_lock(&ferror_table[i].lock);
+		__hash_table_clear(&ferror_table[i]);
+		pthread_mutex_unlock(&ferror_table[i].lock);
 	}
-	pthread_mutex_unlock(&hash_table_mutex);
+
+	if (callsite_collisions)
+		fprintf(stderr, TAG "%lu call-site hash collisions detected\n",
+			callsite_collisions);
+	if (merged_stacks)
+		fprintf(stderr,
+			TAG "%s%lu stacks merged by collapsing recursion\n",
+			merged_overflow ? "at least " : "", merged_stacks);
 
 	if (failed)
 		return;
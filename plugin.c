@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: MIT
+/* Copyright (C) 2026, The libfailinj contributors */
+
+/*
+ * Plugin loaded by test-dlopen, built once per name given in PLUGIN so
+ * each copy allocates from functions named after it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define _cat(a, b) a##b
+#define cat(a, b) _cat(a, b)
+#define _str(x) #x
+#define str(x) _str(x)
+
+static void *state;
+
+/* allocations made while the plugin is loaded and unloaded are tracked */
+static void __attribute__((constructor)) cat(PLUGIN, _init)(void)
+{
+	state = malloc(16);
+}
+
+static void __attribute__((destructor)) cat(PLUGIN, _fini)(void)
+{
+	free(state);
+}
+
+int cat(PLUGIN, _run)(void)
+{
+	void *x;
+
+	if (!state) {
+		fprintf(stderr, str(PLUGIN) " setup failed\n");
+		return 1;
+	}
+
+	x = malloc(32);
+	if (!x) {
+		fprintf(stderr, str(PLUGIN) " allocation failed\n");
+		return 1;
+	}
+
+	free(x);
+	return 0;
+}
@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: MIT
+/* Copyright (C) 2026, The libfailinj contributors */
+
+/*
+ * test-dlopen loads a plugin, makes a call inside it that may fail,
+ * unloads it and then does the same with a second plugin, which usually
+ * ends up mapped where the first one was. Loading itself may fail too,
+ * in the loader or in the plugin's constructor.
+ */
+
+#include <dlfcn.h>
+#include <stdio.h>
+
+static int run_plugin(const char *path, const char *fn)
+{
+	int (*run)(void);
+	void *handle;
+	int ret;
+
+	handle = dlopen(path, RTLD_NOW);
+	if (!handle) {
+		fprintf(stderr, "Unable to load %s: %s\n", path, dlerror());
+		return 1;
+	}
+
+	run = (int (*)(void))dlsym(handle, fn);
+	if (!run) {
+		fprintf(stderr, "No %s in %s\n", fn, path);
+		dlclose(handle);
+		return 2;
+	}
+
+	ret = run();
+	dlclose(handle);
+	return ret;
+}
+
+int main(void)
+{
+	int ret;
+
+	ret = run_plugin("./plugin1.so", "plugin1_run");
+	if (ret)
+		return ret;
+
+	return run_plugin("./plugin2.so", "plugin2_run");
+}
@@ -14,11 +14,22 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+/*
+ * test-moved is built with MOVE_CODE, which leaves every line where it
+ * is but moves the code after it further into the function.
+ */
+#ifdef MOVE_CODE
+#define move_code() asm volatile(".skip 64, 0x90")
+#else
+#define move_code() do {} while (0)
+#endif
+
 static int test_fd(void *x)
 {
 	ssize_t rd;
 	int fd;
 
+	move_code();
 	fd = open("/dev/zero", O_RDWR);
 	if (fd == -1) {
 		perror("Unable to open /dev/zero");
@@ -80,6 +91,7 @@ static int test_stdio(void *x)
 	FILE *f;
 	int ret;
 
+	move_code();
 	f = fopen("/dev/null", "w+");
 	if (!f) {
 		perror("Unable to open /dev/null");
@@ -392,6 +404,7 @@ int main(int argc, char *argv[])
 	void *x, *y;
 	int ret;
 
+	move_code();
 	x = malloc(50);
 	if (!x) {
 		/*
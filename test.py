@@ -6,11 +6,26 @@ import unittest
 import os
 import pathlib
 import shutil
+import struct
 import subprocess
 import sys
 import tempfile
 
 ROOT = pathlib.Path(__file__).absolute().parent
+DB_HEADER_SIZE = 32
+
+def baseline_db(stacks):
+    """A database as versions without a header wrote it: for each
+    call-site, the djb hash of every frame's function+0xoffset, from the
+    library's own frames down to _start."""
+    data = b""
+    for stack in stacks:
+        h = 53815381
+        for frame in stack:
+            for c in frame.encode():
+                h = ((h * 33) ^ c) & (2 ** 64 - 1)
+        data += h.to_bytes(8, sys.byteorder)
+    return data
 
 class TestCode(enum.IntEnum):
     SUCCESS = 0
@@ -91,7 +106,7 @@ class FailCovTestCase(unittest.TestCase):
             env["FAILINJ_DATABASE"] = str(db)
         return subprocess.run([payload] + args, cwd=ROOT, env=env,
                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
-                           text=True)
+                           text=True, errors="backslashreplace")
 
     def run_test(self, *args, **kws):
         p = self._run_test(*args, **kws)
@@ -168,6 +183,388 @@ class FailCovTestCase(unittest.TestCase):
     def test_skip_specific(self):
         self.run_tests(env={"FAILINJ_SKIP_INJECTION": "test_skip_failure"})
 
+    def test_build_id(self):
+        self.run_tests(env={"FAILINJ_CALLSITE_ID": "build-id"})
+
+    def test_crc32c_hash(self):
+        self.run_tests(env={"FAILINJ_HASH": "crc32c"})
+
+    def test_crc32c_build_id(self):
+        self.run_tests(env={"FAILINJ_HASH": "crc32c",
+                            "FAILINJ_CALLSITE_ID": "build-id"})
+
+    def test_crc32c_generic(self):
+        with tempfile.NamedTemporaryFile() as db, \
+             tempfile.NamedTemporaryFile() as db_generic:
+            for i in range(10):
+                self.run_test(db.name, env={"FAILINJ_HASH": "crc32c"})
+                self.run_test(db_generic.name,
+                              env={"FAILINJ_HASH": "crc32c-generic"})
+
+            db_data = pathlib.Path(db.name).read_bytes()
+            self.assertEqual(len(db_data), DB_HEADER_SIZE + 10 * 8)
+            self.assertEqual(db_data,
+                             pathlib.Path(db_generic.name).read_bytes())
+
+    def test_mix128_hash(self):
+        self.run_tests(env={"FAILINJ_HASH": "mix128"})
+
+    def test_verify_callsites(self):
+        self.run_tests(env={"FAILINJ_VERIFY_CALLSITES": "1"})
+
+    def test_verify_callsites_mix128_build_id(self):
+        self.run_tests(env={"FAILINJ_VERIFY_CALLSITES": "1",
+                            "FAILINJ_HASH": "mix128",
+                            "FAILINJ_CALLSITE_ID": "build-id"})
+
+    def test_db_settings(self):
+        with tempfile.NamedTemporaryFile() as db:
+            p = self.run_test(db.name, env={"FAILINJ_HASH": "mix128"})
+            self.assertEqual(TestCode.SEGFAULT, p.returncode)
+
+            p = self.run_test(db.name, env={"FAILINJ_HASH": "djb"})
+            self.assertEqual(TestCode.FAILINJ_ERROR, p.returncode)
+
+            # without the variable, the database's setting is used
+            p = self.run_test(db.name)
+            self.assertEqual(TestCode.FAILINJ_BUG_FOUND, p.returncode)
+
+    def test_unknown_callsite_id(self):
+        with tempfile.NamedTemporaryFile() as db:
+            p = self.run_test(db.name, env={"FAILINJ_CALLSITE_ID": "symbols"})
+            self.assertEqual(TestCode.FAILINJ_ERROR, p.returncode)
+            self.assertEqual(pathlib.Path(db.name).read_bytes(), b"")
+
+    def test_unknown_hash(self):
+        with tempfile.NamedTemporaryFile() as db:
+            p = self.run_test(db.name, env={"FAILINJ_HASH": "crc32"})
+            self.assertEqual(TestCode.FAILINJ_ERROR, p.returncode)
+            self.assertEqual(pathlib.Path(db.name).read_bytes(), b"")
+
+    def test_legacy_db(self):
+        stacks = [["should_fail+0x5b", "malloc+0x2d", "main+0x31",
+                   "__libc_start_main+0xf3", "_start+0x2e"],
+                  ["should_fail+0x5b", "open+0x4a", "main+0x9c",
+                   "__libc_start_main+0xf3", "_start+0x2e"]]
+        with tempfile.NamedTemporaryFile() as legacy:
+            data = baseline_db(stacks)
+            pathlib.Path(legacy.name).write_bytes(data)
+
+            p = self.run_test(legacy.name)
+            self.assertEqual(TestCode.FAILINJ_ERROR, p.returncode)
+            self.assertIn("Database has no header", p.stdout)
+            self.assertEqual(pathlib.Path(legacy.name).read_bytes(), data)
+
+    def test_hash_collision(self):
+        env = {"FAILINJ_VERIFY_CALLSITES": "1"}
+        with tempfile.NamedTemporaryFile() as db:
+            self.run_test(db.name, env=dict(env))
+            data = bytearray(pathlib.Path(db.name).read_bytes())
+
+            # Same hash as the first call-site, but different frames
+            data[-1] ^= 0xff
+            pathlib.Path(db.name).write_bytes(data)
+
+            p = self.run_test(db.name, env=dict(env))
+            self.assertEqual(TestCode.SEGFAULT, p.returncode)
+
+            p = self.run_test(db.name, env=dict(env))
+            self.assertEqual(TestCode.FAILINJ_BUG_FOUND, p.returncode)
+            self.assertIn("1 call-site hash collisions detected", p.stdout)
+
+    def test_collapse_recursion(self):
+        self.run_tests(env={"FAILINJ_COLLAPSE_RECURSION": "2"})
+
+    def test_collapse_recursion_merges(self):
+        env = {"FAILINJ_COLLAPSE_RECURSION": "1"}
+        with tempfile.NamedTemporaryFile() as db:
+            for i in range(20):
+                p = self.run_test(db.name, env=dict(env), payload="./bench",
+                                  args=["malloc", "4", "1"])
+                if p.returncode == TestCode.FAILINJ_DONE:
+                    break
+            self.assertEqual(TestCode.FAILINJ_DONE, p.returncode)
+
+            p = self.run_test(db.name, env=dict(env), payload="./bench",
+                              args=["malloc", "9", "1"])
+            self.assertEqual(TestCode.FAILINJ_DONE, p.returncode)
+            self.assertIn("stacks merged by collapsing recursion", p.stdout)
+
+            del env["FAILINJ_COLLAPSE_RECURSION"]
+            p = self.run_test(db.name, env=dict(env), payload="./bench",
+                              args=["malloc", "9", "1"])
+            self.assertEqual(TestCode.FAILINJ_DONE, p.returncode)
+
+    def test_context_depth(self):
+        self.run_tests(env={"FAILINJ_CONTEXT_DEPTH": "1"})
+
+    def test_context_depth_fp(self):
+        self.run_tests(env={"FAILINJ_CONTEXT_DEPTH": "2",
+                            "FAILINJ_UNWINDER": "fp"})
+
+    def test_mem_context_depth(self):
+        env = {"FAILINJ_MEM_CONTEXT_DEPTH": "2"}
+        with tempfile.NamedTemporaryFile() as db:
+            for i in range(20):
+                p = self.run_test(db.name, env=dict(env), payload="./bench",
+                                  args=["malloc", "4", "1"])
+                if p.returncode == TestCode.FAILINJ_DONE:
+                    break
+            self.assertEqual(TestCode.FAILINJ_DONE, p.returncode)
+
+            p = self.run_test(db.name, env=dict(env), payload="./bench",
+                              args=["malloc", "9", "1"])
+            self.assertEqual(TestCode.FAILINJ_DONE, p.returncode)
+
+            # the depth only applies to the memory functions
+            p = self.run_test(db.name, env=dict(env), payload="./bench",
+                              args=["read", "9", "1"])
+            self.assertEqual(TestCode.EXPECTED_ERROR, p.returncode)
+            self.assertIn("Injecting failure in open()", p.stdout)
+
+    def test_context_depth_leak_report(self):
+        # the frames beyond the context depth are still tracked
+        env = {"FAILINJ_MEM_CONTEXT_DEPTH": "1", "FAILINJ_ANCHORS": ""}
+        with tempfile.NamedTemporaryFile() as db:
+            for i in range(20):
+                p = self.run_test(db.name, env=dict(env))
+                if "Possible memory leak" in p.stdout:
+                    break
+            report = p.stdout.split("Possible memory leak")[1]
+            self.assertIn("main+", report)
+            self.assertIn("_start+", report)
+
+    def test_context_db_settings(self):
+        env = {"FAILINJ_MEM_CONTEXT_DEPTH": "2"}
+        with tempfile.NamedTemporaryFile() as db:
+            p = self.run_test(db.name, env=dict(env))
+            self.assertEqual(TestCode.SEGFAULT, p.returncode)
+
+            for other in [{}, {"FAILINJ_MEM_CONTEXT_DEPTH": "3"},
+                          {**env, "FAILINJ_CONTEXT_DEPTH": "4"},
+                          {**env, "FAILINJ_ANCHORS": "main"}]:
+                with self.subTest(other=other):
+                    p = self.run_test(db.name, env=dict(other))
+                    self.assertEqual(TestCode.FAILINJ_ERROR, p.returncode)
+                    self.assertIn("do not match the database", p.stdout)
+
+            # a depth of 0 is the same as leaving it unset
+            p = self.run_test(db.name, env={**env,
+                                            "FAILINJ_CONTEXT_DEPTH": "0"})
+            self.assertEqual(TestCode.FAILINJ_BUG_FOUND, p.returncode)
+
+    def test_truncated_header_db(self):
+        with tempfile.NamedTemporaryFile() as db:
+            pathlib.Path(db.name).write_bytes(b"FAILINJ\1" + bytes(16))
+            p = self.run_test(db.name)
+            self.assertEqual(TestCode.FAILINJ_ERROR, p.returncode)
+            self.assertIn("header is truncated", p.stdout)
+
+    def test_exclude_callers(self):
+        with tempfile.NamedTemporaryFile() as db:
+            p = self.run_test(db.name, payload="./bench",
+                              args=["strdup", "4", "1"])
+            self.assertEqual(TestCode.EXPECTED_ERROR, p.returncode)
+            self.assertIn("Injecting failure in malloc()", p.stdout)
+
+        # strdup() calls malloc() from within libc
+        env = {"FAILINJ_EXCLUDE_CALLERS": "libc.so ld-linux"}
+        with tempfile.NamedTemporaryFile() as db:
+            p = self.run_test(db.name, env=env, payload="./bench",
+                              args=["strdup", "4", "1"])
+            self.assertEqual(TestCode.FAILINJ_DONE, p.returncode)
+
+        self.run_tests(env={"FAILINJ_EXCLUDE_CALLERS": "libc.so ld-linux"})
+
+    def test_symbol_cache(self):
+        with tempfile.TemporaryDirectory() as cache:
+            env = {"FAILINJ_SYMBOL_CACHE": cache}
+            self.run_tests(env=dict(env))
+            files = list(pathlib.Path(cache).glob("*.sym"))
+            self.assertTrue(files)
+
+            # the filter ranges in the cache depend on the list of names
+            self.run_tests(env={**env,
+                                "FAILINJ_SKIP_INJECTION": "test_skip_failure"})
+
+            # stale or damaged files are ignored and rewritten
+            for f in files:
+                data = f.read_bytes()
+                f.write_bytes(data[:8] + bytes(8) + data[16:])
+            self.run_tests(env=dict(env))
+            for f in files:
+                self.assertNotEqual(f.read_bytes()[8:16], bytes(8))
+
+            # so are sizes that only add up by wrapping around
+            nr_syms = 1 << 28
+            for f in files:
+                data = f.read_bytes()
+                nr_ranges = struct.unpack("=3I", data[40:52])
+                size = 64 + (nr_syms + sum(nr_ranges)) * 16
+                names_size = (len(data) - size) % (1 << 64)
+                f.write_bytes(data[:52] +
+                              struct.pack("=IQ", nr_syms, names_size) +
+                              data[64:])
+            self.run_tests(env=dict(env))
+            for f in files:
+                data = f.read_bytes()
+                self.assertNotEqual(struct.unpack("=I", data[52:56]),
+                                    (nr_syms, ))
+
+    def test_raw_backtraces(self):
+        with tempfile.NamedTemporaryFile() as log, \
+             tempfile.NamedTemporaryFile() as db:
+            env = {"FAILINJ_RAW_BACKTRACES": log.name}
+            self.run_tests(env=dict(env))
+
+            p = self.run_test(db.name, env=dict(env))
+            self.assertIn("raw backtrace in", p.stdout)
+            self.assertNotIn("main+0x", p.stdout)
+
+            p = subprocess.run([ROOT / "failinj-symbolize", log.name],
+                               stdout=subprocess.PIPE, text=True)
+            self.assertEqual(p.returncode, 0)
+            self.assertIn("FAILINJ: Injecting failure in malloc() at:\n"
+                          "    main+0x", p.stdout)
+            self.assertIn("FAILINJ: Possible memory leak", p.stdout)
+
+    def run_until_done(self, db, env={}, payload="./test"):
+        for i in range(len(self._expected_codes)):
+            p = self.run_test(db, env=dict(env), payload=payload)
+            if p.returncode == TestCode.FAILINJ_DONE:
+                break
+        self.assertEqual(TestCode.FAILINJ_DONE, p.returncode)
+        return i + 1
+
+    def test_line_callsite_id(self):
+        self.run_tests(env={"FAILINJ_CALLSITE_ID": "line"})
+
+        # test-moved has the same lines as test but its code moved
+        with tempfile.NamedTemporaryFile() as db:
+            self.run_until_done(db.name)
+            self.assertGreater(self.run_until_done(db.name,
+                                                   payload="./test-moved"), 1)
+
+        with tempfile.NamedTemporaryFile() as db:
+            self.run_until_done(db.name, {"FAILINJ_CALLSITE_ID": "line"})
+            self.assertEqual(self.run_until_done(db.name,
+                                                 payload="./test-moved"), 1)
+
+    def migrate(self, old, new):
+        return subprocess.run([ROOT / "failinj-migrate", old, new, "./test"],
+                              cwd=ROOT, stdout=subprocess.PIPE,
+                              stderr=subprocess.STDOUT, text=True)
+
+    def test_migrate_db(self):
+        for scheme in ["djb", "mix128"]:
+            with tempfile.NamedTemporaryFile() as old, \
+                 tempfile.NamedTemporaryFile() as new:
+                self.run_until_done(old.name,
+                                    {"FAILINJ_VERIFY_CALLSITES": "1",
+                                     "FAILINJ_HASH": scheme})
+                p = self.migrate(old.name, new.name)
+                self.assertEqual(p.returncode, 0, p.stdout)
+                self.assertEqual(self.run_until_done(new.name,
+                                                     payload="./test-moved"), 1)
+
+        # without the frames of each call-site there is nothing to go by
+        with tempfile.NamedTemporaryFile() as old, \
+             tempfile.NamedTemporaryFile() as new:
+            self.run_test(old.name)
+            self.assertEqual(self.migrate(old.name, new.name).returncode, 1)
+
+        # nor for the thread or fiber a call was made in
+        for origin in ["FAILINJ_THREAD_ORIGIN", "FAILINJ_THREAD_ROLE",
+                       "FAILINJ_FIBER_ORIGIN"]:
+            with tempfile.NamedTemporaryFile() as old, \
+                 tempfile.NamedTemporaryFile() as new:
+                self.run_test(old.name, env={"FAILINJ_VERIFY_CALLSITES": "1",
+                                             origin: "1"})
+                self.assertEqual(self.migrate(old.name, new.name).returncode,
+                                 1)
+
+    def count_thread_injections(self, env, payload="./bench", op="threads",
+                                func="bench_worker"):
+        injections = 0
+        with tempfile.NamedTemporaryFile() as db:
+            for i in range(20):
+                p = self.run_test(db.name, env=dict(env), payload=payload,
+                                  args=[op, "0", "1"])
+                if func in p.stdout:
+                    injections += 1
+                if p.returncode == TestCode.FAILINJ_DONE:
+                    break
+            self.assertEqual(TestCode.FAILINJ_DONE, p.returncode)
+        return injections
+
+    def test_thread_origin(self):
+        # three threads created from different places run the same code
+        self.assertEqual(self.count_thread_injections({}), 1)
+        self.assertEqual(self.count_thread_injections(
+            {"FAILINJ_THREAD_ORIGIN": "1"}), 3)
+        self.assertEqual(self.count_thread_injections(
+            {"FAILINJ_THREAD_ORIGIN": "1"}, payload="./bench-shadow"), 3)
+
+    def test_thread_role(self):
+        # worker-1 and worker-2 share a role
+        self.assertEqual(self.count_thread_injections(
+            {"FAILINJ_THREAD_ROLE": "1"}), 2)
+
+        with tempfile.NamedTemporaryFile() as db:
+            self.run_test(db.name, env={"FAILINJ_THREAD_ROLE": "1"},
+                          payload="./bench", args=["threads", "0", "1"])
+            p = self.run_test(db.name, env={"FAILINJ_THREAD_ORIGIN": "1"},
+                              payload="./bench", args=["threads", "0", "1"])
+            self.assertEqual(TestCode.FAILINJ_ERROR, p.returncode)
+
+    def test_fiber_origin(self):
+        # three fibers made from different places run the same code
+        env = {"FAILINJ_FIBER_ORIGIN": "1"}
+        self.assertEqual(self.count_thread_injections(
+            {}, op="fibers", func="bench_fiber"), 1)
+        self.assertEqual(self.count_thread_injections(
+            env, op="fibers", func="bench_fiber"), 3)
+        self.assertEqual(self.count_thread_injections(
+            {**env, "FAILINJ_UNWINDER": "fp"}, op="fibers",
+            func="bench_fiber"), 3)
+
+    def test_concurrent_threads(self):
+        # eight threads freeing and reallocating their share of the live
+        # allocations at once, every one of which must be tracked. glibc
+        # keeps the TLS of joined threads for reuse.
+        env = {"FAILINJ_IGNORE_MEM_LEAKS": "_dl_allocate_tls"}
+        with tempfile.NamedTemporaryFile() as db:
+            for i in range(20):
+                p = self.run_test(db.name, payload="./bench",
+                                  args=["churn", "0", "200", "1000", "8"],
+                                  env=dict(env))
+                self.assertLessEqual(p.stdout.count("Injecting failure"), 1)
+                self.assertNotEqual(TestCode.FAILINJ_BUG_FOUND, p.returncode)
+                if p.returncode == TestCode.FAILINJ_DONE:
+                    break
+            self.assertEqual(TestCode.FAILINJ_DONE, p.returncode)
+
+    def test_shadow_stack(self):
+        self.run_tests(payload="./test-shadow")
+
+    def test_shadow_stack_db(self):
+        with tempfile.NamedTemporaryFile() as db:
+            p = self.run_test(db.name, payload="./test-shadow")
+            self.assertEqual(TestCode.SEGFAULT, p.returncode)
+
+            # callsite_id in the header is CALLSITE_ID_SHADOW
+            hdr = pathlib.Path(db.name).read_bytes()[:DB_HEADER_SIZE]
+            self.assertEqual(int.from_bytes(hdr[12:16], "little"), 2)
+
+            p = self.run_test(db.name)
+            self.assertEqual(TestCode.FAILINJ_ERROR, p.returncode)
+
+    def test_fp_unwinder(self):
+        self.run_tests(env={"FAILINJ_UNWINDER": "fp"})
+
+    def test_no_anchors(self):
+        self.run_tests(env={"FAILINJ_ANCHORS": ""})
+
     def test_invalid_db(self):
         p = self.run_test("/not/a/valid/path/123/database")
         self.assertEqual(TestCode.FAILINJ_ERROR, p.returncode)
@@ -191,6 +588,42 @@ class FailCovTestCase(unittest.TestCase):
         self.run_tests(payload="./test3",
                        expected_codes=self._expected_test3_codes)
 
+    def run_dlopen_tests(self, env):
+        # How many calls the loader makes depends on the libc, so run
+        # until no new call-site is left rather than expecting a list.
+        # The loader keeps some of what it allocates until exit, and the
+        # fp unwinder cannot walk its frames to tell which.
+        env = dict(env, FAILINJ_IGNORE_ALL_MEM_LEAKS="y")
+        out = ""
+
+        with tempfile.NamedTemporaryFile() as db:
+            for i in range(100):
+                p = self._run_test(db.name, env=dict(env),
+                                   payload="./test-dlopen")
+                out += p.stdout
+                if p.returncode == TestCode.FAILINJ_DONE:
+                    return out
+                if p.returncode not in (TestCode.SUCCESS,
+                                        TestCode.EXPECTED_ERROR):
+                    print(p.stdout)
+                self.assertIn(p.returncode, (TestCode.SUCCESS,
+                                             TestCode.EXPECTED_ERROR))
+
+        self.fail("test-dlopen never ran out of call-sites")
+
+    def test_dlopen(self):
+        # the second plugin likely reuses the first one's addresses
+        for env in [{}, {"FAILINJ_CALLSITE_ID": "build-id"},
+                    {"FAILINJ_CALLSITE_ID": "line"},
+                    {"FAILINJ_UNWINDER": "fp"}]:
+            with self.subTest(env=env):
+                out = self.run_dlopen_tests(env)
+                for fn in ["plugin1_init", "plugin1_run",
+                           "plugin2_init", "plugin2_run"]:
+                    self.assertIn("FAILINJ: Injecting failure in malloc() "
+                                  "at:\n    " + fn + "+0x", out)
+                self.assertNotIn("untracked", out)
+
     def check_no_segfault(self, db, iterations=25, payload=None, env=None,
                           allow_failinj_err=False):
         exp = (TestCode.SUCCESS,
@@ -219,6 +652,15 @@ class FailCovTestCase(unittest.TestCase):
             with tempfile.NamedTemporaryFile() as db:
                 self.check_no_segfault(db, payload=str(s))
 
+    def test_stripped_build_id(self):
+        # With build-id callsites, stripped executables work as normal
+
+        with tempfile.TemporaryDirectory() as tmpdirname:
+            s = pathlib.Path(tmpdirname) / "test_stripped"
+            subprocess.check_call(["strip", str(ROOT / "test"), "-o", str(s)])
+            self.run_tests(payload=str(s),
+                           env={"FAILINJ_CALLSITE_ID": "build-id"})
+
     def test_zzdogfood(self):
         """Test the library with itself to check the final corner cases.
            There isn't much checking save for ensuring it doesn't segfault"""